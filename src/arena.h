@@ -0,0 +1,83 @@
+// File: arena.h
+// Description: Slab allocator for objects which are all released at once and whose memory is reused
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Hands out objects from fixed size blocks of uninitialized storage.
+// Objects are never destroyed individually. reset() releases all of them at once but keeps the blocks, so a slab
+// which is reused for work of a similar size stops allocating after the first use.
+template <typename T>
+class Slab {
+    static_assert(std::is_trivially_destructible_v<T>, "Objects are released without running their destructor");
+
+public:
+    /**
+     * @param block_size Number of objects each block holds
+     */
+    explicit Slab(int block_size) : block_size_(block_size) {
+        assert(block_size > 0);
+    }
+
+    Slab(const Slab&) = delete;
+    Slab& operator=(const Slab&) = delete;
+
+    /**
+     * Construct an object in the next free slot.
+     * @param args Arguments forwarded to the constructor of T
+     * @return Pointer to the object, stable until reset()
+     */
+    template <typename... Args>
+    T* emplace(Args&&... args) {
+        if (used_ == block_size_) {
+            ++block_;
+            used_ = 0;
+        }
+        if (block_ == (int)blocks_.size()) {
+            void* block = ::operator new(sizeof(T) * block_size_, std::align_val_t(alignof(T)));
+            blocks_.emplace_back(static_cast<T*>(block));
+        }
+        ++size_;
+        return new (blocks_[block_].get() + used_++) T(std::forward<Args>(args)...);
+    }
+
+    // Release all objects, keeping the blocks for reuse
+    void reset() {
+        block_ = 0;
+        used_ = 0;
+        size_ = 0;
+    }
+
+    // Number of objects handed out since the last reset
+    int size() const {
+        return size_;
+    }
+
+    // Number of objects the allocated blocks can hold
+    int capacity() const {
+        return (int)blocks_.size() * block_size_;
+    }
+
+private:
+    struct BlockDeleter {
+        void operator()(T* block) const {
+            ::operator delete(block, std::align_val_t(alignof(T)));
+        }
+    };
+
+    int block_size_;
+    std::vector<std::unique_ptr<T, BlockDeleter>> blocks_;
+    int block_ = 0;    // Block currently being handed out from
+    int used_ = 0;     // Slots used in the current block
+    int size_ = 0;
+};
+
+#endif    // ARENA_H_
@@ -0,0 +1,249 @@
+#include <benchmark/benchmark.h>
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "arena.h"
+#include "model.h"
+#include "model_evaluator.h"
+#include "rnd/image_renderer.h"
+#include "rnd/level_pack.h"
+#include "rnd/stonesngems_base.h"
+#include "rnd/util.h"
+#include "search.h"
+#include "search_scheduler.h"
+#include "thread_pool.h"
+#include "transposition_table.h"
+#include "types.h"
+
+namespace {
+
+const int ENV_WIDTH = 16;
+const int ENV_HEIGHT = 16;
+const int ENV_CHANNELS = stonesngems::kNumVisibleCellType;
+const int NUM_ACTIONS = 5;
+const ObservationShape OBSERVATION_SHAPE = {ENV_CHANNELS, ENV_HEIGHT, ENV_WIDTH};
+const int SEARCHES_PER_THREAD = 16;
+const int END_TO_END_PUZZLES = 32;
+
+// Same board as main
+const std::string BOARD_STR = "16|16|9999|1|02|02|02|01|01|02|02|02|02|39|02|02|02|02|02|02|02|02|02|02|02|02|02|01|02|02|02|02|02|02|02|02|02|03|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|01|02|02|01|02|02|02|02|02|02|02|02|03|02|02|02|02|02|02|02|01|02|02|02|02|02|39|02|02|02|02|07|01|02|01|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|00|02|02|02|02|02|03|02|02|02|02|02|02|01|02|02|02|02|02|02|01|02|02|02|03|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|01|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|01|02|02|02|02|02|01|02|02|03|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|39|02|02|02|02|02|39|02|02|02|02|02|02|01|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|39|02|02|02|02|01|02|02|02|02|02";
+
+RNDGameState make_state() {
+    GameParameters params = kDefaultGameParams;
+    params["game_board_str"] = GameParameter(BOARD_STR);
+    params["gravity"] = GameParameter(false);
+    return RNDGameState(params);
+}
+
+// Distinct non-terminal states reachable from the start, in breadth first order
+std::vector<RNDGameState> reachable_states(int max_states) {
+    std::vector<RNDGameState> states{make_state()};
+    std::unordered_set<uint64_t> seen{states[0].get_hash()};
+    std::array<RNDGameState, kNumActions> children;
+    for (std::size_t i = 0; i < states.size() && (int)states.size() < max_states; ++i) {
+        states[i].expand_all(children);
+        for (const auto &child : children) {
+            if ((int)states.size() < max_states && !child.is_terminal() && seen.insert(child.get_hash()).second) {
+                states.push_back(child);
+            }
+        }
+    }
+    return states;
+}
+
+void BM_StateCopy(benchmark::State &bench_state) {
+    const RNDGameState state = make_state();
+    for (auto _ : bench_state) {
+        RNDGameState copy = state;
+        benchmark::DoNotOptimize(copy);
+    }
+}
+BENCHMARK(BM_StateCopy);
+
+void BM_ApplyAction(benchmark::State &bench_state) {
+    const RNDGameState start = make_state();
+    const auto &actions = RNDGameState::kLegalActions;
+    RNDGameState state = start;
+    std::size_t i = 0;
+    for (auto _ : bench_state) {
+        if (state.is_terminal()) {
+            state = start;
+        }
+        state.apply_action(actions[i++ % actions.size()]);
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_ApplyAction);
+
+void BM_ExpandAll(benchmark::State &bench_state) {
+    const RNDGameState state = make_state();
+    std::array<RNDGameState, kNumActions> children;
+    for (auto _ : bench_state) {
+        state.expand_all(children);
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_ExpandAll);
+
+void BM_GetObservation(benchmark::State &bench_state) {
+    const RNDGameState state = make_state();
+    for (auto _ : bench_state) {
+        benchmark::DoNotOptimize(state.get_observation());
+    }
+}
+BENCHMARK(BM_GetObservation);
+
+void BM_WriteObservation(benchmark::State &bench_state) {
+    const RNDGameState state = make_state();
+    std::vector<float> observation(state.observation_size());
+    for (auto _ : bench_state) {
+        state.write_observation(observation.data());
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_WriteObservation);
+
+void BM_WriteImage(benchmark::State &bench_state) {
+    const RNDGameState state = make_state();
+    std::vector<uint8_t> image(state.image_size());
+    for (auto _ : bench_state) {
+        state.write_image(image.data());
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_WriteImage);
+
+// Frames of a playout, each only redrawing the cells changed by the last action
+void BM_RenderIncremental(benchmark::State &bench_state) {
+    const RNDGameState start = make_state();
+    const auto &actions = RNDGameState::kLegalActions;
+    RNDGameState state = start;
+    stonesngems::IncrementalRenderer renderer(ENV_HEIGHT, ENV_WIDTH);
+    std::vector<uint8_t> image(state.image_size());
+    std::vector<int8_t> cell_types(state.cell_types_size());
+    std::size_t i = 0;
+    for (auto _ : bench_state) {
+        if (state.is_terminal()) {
+            state = start;
+        }
+        state.apply_action(actions[i++ % actions.size()]);
+        state.write_cell_types(cell_types.data());
+        renderer.render(cell_types.data(), image.data());
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_RenderIncremental);
+
+void BM_GetHash(benchmark::State &bench_state) {
+    const RNDGameState state = make_state();
+    for (auto _ : bench_state) {
+        benchmark::DoNotOptimize(state.get_hash());
+    }
+}
+BENCHMARK(BM_GetHash);
+
+void BM_ParseBoardStr(benchmark::State &bench_state) {
+    for (auto _ : bench_state) {
+        benchmark::DoNotOptimize(util::parse_board_str(BOARD_STR));
+    }
+}
+BENCHMARK(BM_ParseBoardStr);
+
+void BM_StateFromBoardStr(benchmark::State &bench_state) {
+    for (auto _ : bench_state) {
+        benchmark::DoNotOptimize(make_state());
+    }
+}
+BENCHMARK(BM_StateFromBoardStr);
+
+// Starting a state from a binary level as read from a level pack, with the tables of an existing state
+void BM_StateFromLevel(benchmark::State &bench_state) {
+    const RNDGameState base = make_state();
+    std::vector<char> encoded;
+    util::encode_level(util::view_level(util::parse_board_spec(BOARD_STR)), encoded);
+    for (auto _ : bench_state) {
+        benchmark::DoNotOptimize(RNDGameState(base, util::decode_level(encoded.data(), encoded.size())));
+    }
+}
+BENCHMARK(BM_StateFromLevel);
+
+// Inserting distinct states as the search's StateContainer does, copying each into a slab on first sight
+void BM_StateContainerInsert(benchmark::State &bench_state) {
+    const std::vector<RNDGameState> states = reachable_states(bench_state.range(0));
+    Slab<RNDGameState> slab(2000);
+    TranspositionTable<RNDGameState, void> table(4000);
+    for (auto _ : bench_state) {
+        for (const auto &state : states) {
+            auto [entry, inserted] = table.insert(state.get_hash(), state);
+            if (inserted) {
+                entry->state = slab.emplace(state);
+            }
+        }
+        table.clear();
+        slab.reset();
+    }
+    bench_state.SetItemsProcessed(bench_state.iterations() * states.size());
+}
+BENCHMARK(BM_StateContainerInsert)->Arg(2000)->Arg(20000);
+
+// Forward pass at each batch size, arg 1 selects cell type inputs over full observations
+void BM_Inference(benchmark::State &bench_state) {
+    const int batch_size = bench_state.range(0);
+    const bool compact = bench_state.range(1) != 0;
+    const std::vector<RNDGameState> states = reachable_states(batch_size);
+    TwoHeadedConvNetWrapper model(OBSERVATION_SHAPE, NUM_ACTIONS, "cuda:0", 512);
+    ObservationBatch observations(states[0].observation_size(), batch_size);
+    CellTypeBatch cell_types(states[0].cell_types_size(), batch_size);
+    for (int i = 0; i < batch_size; ++i) {
+        const RNDGameState &state = states[i % states.size()];
+        state.write_observation(observations.append());
+        state.write_cell_types(cell_types.append());
+    }
+    for (auto _ : bench_state) {
+        InferenceBatchOutput output = compact ? model.Inference(cell_types) : model.Inference(observations);
+        benchmark::DoNotOptimize(output);
+    }
+    bench_state.SetItemsProcessed(bench_state.iterations() * batch_size);
+}
+BENCHMARK(BM_Inference)->ArgsProduct({benchmark::CreateRange(1, 512, 2), {0, 1}})->UseRealTime();
+
+// Multiplexed search over a fixed set of puzzles, args are the number of threads and evaluators
+void BM_EndToEnd(benchmark::State &bench_state) {
+    const int num_threads = bench_state.range(0);
+    const int num_evaluators = bench_state.range(1);
+    ThreadPool<SchedulerInput, SearchStats> pool(num_threads);
+    ModelEvaluatorOptions evaluator_options;
+    evaluator_options.compact_observations = true;
+    std::vector<std::unique_ptr<ModelEvaluator>> evaluators;
+    for (int i = 0; i < num_evaluators; ++i) {
+        evaluator_options.name = std::to_string(i);    // Reuse the metric series across runs
+        evaluators.push_back(std::make_unique<ModelEvaluator>(OBSERVATION_SHAPE, NUM_ACTIONS,
+                                                              num_threads * SEARCHES_PER_THREAD, evaluator_options));
+    }
+    std::vector<SearchInput> inputs;
+    const RNDGameState state = make_state();
+    for (int i = 0; i < END_TO_END_PUZZLES; ++i) {
+        inputs.push_back({i, state, evaluators[i % num_evaluators].get()});
+    }
+
+    int64_t puzzles = 0;
+    int64_t nodes = 0;
+    for (auto _ : bench_state) {
+        for (const auto &result : run_multiplexed_search(pool, num_threads, inputs, SEARCHES_PER_THREAD)) {
+            ++puzzles;
+            nodes += result.stats.expanded;
+        }
+    }
+    bench_state.counters["puzzles/s"] = benchmark::Counter(puzzles, benchmark::Counter::kIsRate);
+    bench_state.counters["nodes/s"] = benchmark::Counter(nodes, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_EndToEnd)->ArgsProduct({{1, 2, 4, 8}, {1, 2}})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+}    // namespace
+
+BENCHMARK_MAIN();
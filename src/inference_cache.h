@@ -0,0 +1,111 @@
+// File: inference_cache.h
+// Description: Thread safe LRU cache of model predictions, keyed by state hash
+
+#ifndef INFERENCE_CACHE_H_
+#define INFERENCE_CACHE_H_
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "types.h"
+
+// Prediction held by the cache, owning its values rather than viewing into a batch output
+struct CachedPrediction {
+    std::vector<float> policy;
+    float heuristic = 0;
+};
+
+// LRU cache split into independently locked shards, so that searches on many threads rarely contend.
+// Each shard evicts its own least recently used entry once it holds capacity / num_shards entries.
+class InferenceCache {
+public:
+    /**
+     * @param capacity Max number of predictions held over all shards
+     * @param num_shards Number of independently locked shards
+     */
+    InferenceCache(int capacity, int num_shards) : num_shards_(num_shards), shards_(new Shard[num_shards]) {
+        assert(capacity > 0 && num_shards > 0);
+        for (int i = 0; i < num_shards; ++i) {
+            shards_[i].capacity = std::max(1, capacity / num_shards);
+        }
+    }
+
+    InferenceCache(const InferenceCache &) = delete;
+    InferenceCache &operator=(const InferenceCache &) = delete;
+
+    /**
+     * Look up the prediction for a key, marking it as recently used.
+     * @param key Hash of the state
+     * @param prediction Set to the cached prediction if found, reusing its storage
+     * @return True if the key was found
+     */
+    bool lookup(uint64_t key, CachedPrediction &prediction) {
+        Shard &shard = shard_for(key);
+        std::unique_lock<std::mutex> lock(shard.m);
+        auto itr = shard.index.find(key);
+        if (itr == shard.index.end()) {
+            return false;
+        }
+        shard.lru.splice(shard.lru.begin(), shard.lru, itr->second);
+        const CachedPrediction &cached = itr->second->second;
+        prediction.policy.assign(cached.policy.begin(), cached.policy.end());
+        prediction.heuristic = cached.heuristic;
+        return true;
+    }
+
+    /**
+     * Store the prediction for a key, evicting the least recently used entry of its shard if full.
+     * @param key Hash of the state
+     * @param prediction Prediction to copy into the cache
+     */
+    void insert(uint64_t key, const InferenceOutput &prediction) {
+        Shard &shard = shard_for(key);
+        std::unique_lock<std::mutex> lock(shard.m);
+        auto itr = shard.index.find(key);
+        if (itr != shard.index.end()) {
+            shard.lru.splice(shard.lru.begin(), shard.lru, itr->second);
+            return;
+        }
+        if ((int)shard.index.size() >= shard.capacity) {
+            // Reuse the evicted node, and so its policy allocation
+            shard.index.erase(shard.lru.back().first);
+            shard.lru.splice(shard.lru.begin(), shard.lru, std::prev(shard.lru.end()));
+        } else {
+            shard.lru.emplace_front();
+        }
+        auto &entry = shard.lru.front();
+        entry.first = key;
+        entry.second.policy.assign(prediction.policy.begin(), prediction.policy.end());
+        entry.second.heuristic = prediction.heuristic;
+        shard.index.emplace(key, shard.lru.begin());
+    }
+
+private:
+    using LRUList = std::list<std::pair<uint64_t, CachedPrediction>>;
+
+    // Padded so that neighbouring locks don't share a cache line
+    struct alignas(64) Shard {
+        std::mutex m;
+        LRUList lru;    // Most recently used at the front
+        std::unordered_map<uint64_t, LRUList::iterator> index;
+        int capacity = 0;
+    };
+
+    Shard &shard_for(uint64_t key) {
+        // Zobrist hashes are uniform, the high bits are used as the maps already bucket on the low bits
+        return shards_[(key >> 32) % num_shards_];
+    }
+
+    int num_shards_;
+    std::unique_ptr<Shard[]> shards_;
+};
+
+#endif    // INFERENCE_CACHE_H_
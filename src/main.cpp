@@ -1,54 +1,218 @@
+#include <chrono>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <string>
 #include <thread>
 #include <vector>
 
 #include "rnd/stonesngems_base.h"
 #include "search.h"
+#include "search_scheduler.h"
+#include "metrics.h"
 #include "model_evaluator.h"
 #include "thread_pool.h"
+#include "trace.h"
 #include "types.h"
 
+// Defaults, each can be overridden on the command line
 const int NUM_THREADS = 8;
+const int SEARCHES_PER_THREAD = 16;    // Searches each thread keeps in flight
+const int NUM_PUZZLES = 100;
+
 const int ENV_WIDTH = 16;
 const int ENV_HEIGHT = 16;
-const int ENV_CHANNELS = 36;
+const int ENV_CHANNELS = stonesngems::kNumVisibleCellType;    // One-hot plane per visible cell type
 const int NUM_ACTIONS = 5;
 
 const ObservationShape OBSERVATION_SHAPE = {ENV_CHANNELS, ENV_HEIGHT, ENV_WIDTH};
 
+// Options given on the command line as --name=value, throwing std::invalid_argument for anything malformed
+class CommandLine {
+public:
+    CommandLine(int argc, char **argv) {
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg(argv[i]);
+            const std::size_t equals = arg.find('=');
+            if (arg.rfind("--", 0) != 0 || equals == std::string::npos) {
+                throw std::invalid_argument("Expected --name=value, got " + arg);
+            }
+            values_[arg.substr(2, equals - 2)] = arg.substr(equals + 1);
+        }
+    }
+
+    // Value of the option, or the default if not given
+    int int_option(const std::string &name, int default_value) {
+        return option(name, default_value, [](const std::string &value, std::size_t *end) {
+            return std::stoi(value, end);
+        });
+    }
+
+    double double_option(const std::string &name, double default_value) {
+        return option(name, default_value, [](const std::string &value, std::size_t *end) {
+            return std::stod(value, end);
+        });
+    }
+
+    // Throw if any option given was never asked for, so misspelt options aren't silently ignored
+    void check_all_used() const {
+        for (const auto &[name, value] : values_) {
+            if (used_.count(name) == 0) {
+                throw std::invalid_argument("Unknown option --" + name);
+            }
+        }
+    }
+
+private:
+    template <typename T, typename Parse>
+    T option(const std::string &name, T default_value, Parse parse) {
+        const auto it = values_.find(name);
+        if (it == values_.end()) {
+            return default_value;
+        }
+        used_.insert(name);
+        try {
+            std::size_t end = 0;
+            const T value = parse(it->second, &end);
+            if (end == it->second.size()) {
+                return value;
+            }
+        } catch (const std::logic_error &) {    // Not a number (invalid_argument), or out_of_range
+        }
+        throw std::invalid_argument("Invalid value for --" + name + ": " + it->second);
+    }
+
+    std::map<std::string, std::string> values_;
+    std::set<std::string> used_;
+};
+
+struct RunOptions {
+    int num_threads = NUM_THREADS;
+    int searches_per_thread = SEARCHES_PER_THREAD;    // Searches each thread keeps in flight
+    int num_puzzles = NUM_PUZZLES;
+    int queue_depth = ModelEvaluatorOptions().queue_depth;
+    int metrics_interval_ms = 0;                      // Period of rewriting metrics.prom while running, 0 for none
+    SearchConfig search_config;
+};
+
+// All options are read up front, so mistakes are reported before any work starts
+RunOptions parse_options(int argc, char **argv) {
+    CommandLine command_line(argc, argv);
+    RunOptions options;
+    options.num_threads = command_line.int_option("threads", options.num_threads);
+    options.searches_per_thread = command_line.int_option("searches_per_thread", options.searches_per_thread);
+    options.num_puzzles = command_line.int_option("num_puzzles", options.num_puzzles);
+    options.queue_depth = command_line.int_option("queue_depth", options.queue_depth);
+    options.metrics_interval_ms = command_line.int_option("metrics_interval_ms", options.metrics_interval_ms);
+    SearchConfig &search_config = options.search_config;
+    search_config.budget_nodes = command_line.int_option("budget_nodes", search_config.budget_nodes);
+    search_config.time_limit = std::chrono::milliseconds(command_line.int_option("time_limit_ms", 0));
+    search_config.inference_batch_size = command_line.int_option("batch_size", search_config.inference_batch_size);
+    search_config.adaptive_batching = command_line.int_option("adaptive_batching", 0) != 0;
+    search_config.max_inference_batch_size =
+        command_line.int_option("max_batch_size", search_config.max_inference_batch_size);
+    search_config.parallel_expansions =
+        command_line.int_option("parallel_expansions", search_config.parallel_expansions);
+    search_config.parallel_handoff_nodes =
+        command_line.int_option("parallel_handoff_nodes", search_config.parallel_handoff_nodes);
+    search_config.policy_epsilon = command_line.double_option("policy_epsilon", search_config.policy_epsilon);
+    command_line.check_all_used();
+    return options;
+}
+
+
+int main(int argc, char **argv) {
+    RunOptions options;
+    try {
+        options = parse_options(argc, argv);
+    } catch (const std::invalid_argument &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    const int num_threads = options.num_threads;
+    const int searches_per_thread = options.searches_per_thread;
+    const SearchConfig &search_config = options.search_config;
+
 
-int main() {
     // Set torch seed
     torch::manual_seed(0);
     torch::cuda::manual_seed_all(0);
     torch::globalContext().setDeterministicCuDNN(true);
     torch::globalContext().setBenchmarkCuDNN(false);
 
-    ThreadPool<SearchInput, bool> pool(NUM_THREADS);
-    std::unique_ptr<ModelEvaluator> evaluator_A = std::make_unique<ModelEvaluator>(OBSERVATION_SHAPE, NUM_ACTIONS, NUM_THREADS);
-    std::unique_ptr<ModelEvaluator> evaluator_B = std::make_unique<ModelEvaluator>(OBSERVATION_SHAPE, NUM_ACTIONS, NUM_THREADS);
+#ifdef ENABLE_TRACING
+    trace::set_enabled(true);
+#endif
+
+    ThreadPool<SchedulerInput, SearchStats> pool(num_threads);
+    const int max_searches = num_threads * searches_per_thread;
+    // Searches send cell type grids, and the one-hot observations are built on the device
+    ModelEvaluatorOptions evaluator_options;
+    evaluator_options.compact_observations = true;
+    evaluator_options.queue_depth = options.queue_depth;
+    evaluator_options.name = "A";
+    std::unique_ptr<ModelEvaluator> evaluator_A =
+        std::make_unique<ModelEvaluator>(OBSERVATION_SHAPE, NUM_ACTIONS, max_searches, evaluator_options);
+    evaluator_options.name = "B";
+    std::unique_ptr<ModelEvaluator> evaluator_B =
+        std::make_unique<ModelEvaluator>(OBSERVATION_SHAPE, NUM_ACTIONS, max_searches, evaluator_options);
 
     std::vector<std::string> board_str {
         "16|16|9999|1|02|02|02|01|01|02|02|02|02|39|02|02|02|02|02|02|02|02|02|02|02|02|02|01|02|02|02|02|02|02|02|02|02|03|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|01|02|02|01|02|02|02|02|02|02|02|02|03|02|02|02|02|02|02|02|01|02|02|02|02|02|39|02|02|02|02|07|01|02|01|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|00|02|02|02|02|02|03|02|02|02|02|02|02|01|02|02|02|02|02|02|01|02|02|02|03|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|01|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|01|02|02|02|02|02|01|02|02|03|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|39|02|02|02|02|02|39|02|02|02|02|02|02|01|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|02|39|02|02|02|02|01|02|02|02|02|02",
     };
     
 
-    std::vector<SearchInput> inputs;
-    inputs.reserve(100);
-    for (int i = 0; i < 100; ++i) {
+    // Starting states are made once per board, and the inputs streamed from them as the searches free up
+    std::vector<stonesngems::RNDGameState> start_states;
+    for (const auto &board : board_str) {
         stonesngems::GameParameters params = stonesngems::kDefaultGameParams;
-        params["game_board_str"] = stonesngems::GameParameter(board_str[i % board_str.size()]);
+        params["game_board_str"] = stonesngems::GameParameter(board);
         params["gravity"] = stonesngems::GameParameter(false);
-        stonesngems::RNDGameState state(params);
-
-        // Alternating threads get alternating models
-        if (i % 2 == 0) {
-            inputs.push_back({i, state, evaluator_A.get() });
-        } else {
-            inputs.push_back({i, state, evaluator_B.get() });
+        start_states.emplace_back(params);
+    }
+    const int num_puzzles = options.num_puzzles;
+    int next_puzzle = 0;
+    auto generator = [&]() -> std::optional<SearchInput> {
+        if (next_puzzle == num_puzzles) {
+            return std::nullopt;
         }
+        const int i = next_puzzle++;
+        // Alternating threads get alternating models
+        ModelEvaluator *evaluator = (i % 2 == 0) ? evaluator_A.get() : evaluator_B.get();
+        return SearchInput{i, start_states[i % start_states.size()], evaluator, search_config};
+    };
+
+    int solved = 0;
+    int finished = 0;
+    SearchStats stats;
+    auto sink = [&](SearchResult result) {
+        ++finished;
+        solved += result.solved;
+        stats += result.stats;
+    };
+
+    // Metrics are rewritten periodically while searching if an interval is given, and once at the end regardless
+    std::unique_ptr<metrics::PeriodicWriter> metrics_writer;
+    const int metrics_interval_ms = options.metrics_interval_ms;
+    if (metrics_interval_ms > 0) {
+        metrics_writer =
+            std::make_unique<metrics::PeriodicWriter>("metrics.prom", std::chrono::milliseconds(metrics_interval_ms));
     }
 
-    std::vector<bool> results = pool.run(search, inputs);
+    run_streaming_search(pool, num_threads, generator, sink, searches_per_thread);
+    metrics_writer.reset();
+    metrics::write_prometheus("metrics.prom");
+
+    std::cout << "Solved " << solved << "/" << finished << ", expanded " << stats.expanded << ", generated "
+              << stats.generated << ", mean inference batch " << stats.mean_inference_batch() << " (max "
+              << stats.max_inference_batch << ")" << std::endl;
+    std::cout << "Thread seconds: expand " << stats.expand_seconds << ", hash " << stats.hash_seconds
+              << ", inference " << stats.inference_seconds << std::endl;
+
+#ifdef ENABLE_TRACING
+    trace::write_chrome_trace("trace.json");
+#endif
 }
\ No newline at end of file
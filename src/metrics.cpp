@@ -0,0 +1,197 @@
+#include "metrics.h"
+
+#include <cassert>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <utility>
+
+namespace metrics {
+
+namespace {
+
+enum class Type { kCounter, kGauge, kHistogram };
+
+// One label set of a metric, only the member matching the family type is set
+struct Series {
+    std::string labels;
+    std::unique_ptr<Counter> counter;
+    std::unique_ptr<Gauge> gauge;
+    std::unique_ptr<Histogram> histogram;
+};
+
+// All label sets sharing a name, exported together under one HELP and TYPE
+struct Family {
+    Type type;
+    std::string help;
+    std::vector<std::unique_ptr<Series>> series;
+};
+
+struct Registry {
+    std::mutex m;
+    std::map<std::string, Family> families;    // Ordered, so the export is stable
+    int num_threads = 0;                       // Threads given a thread_label() so far
+};
+
+Registry &registry() {
+    static Registry instance;
+    return instance;
+}
+
+// Find the series of the name and labels, creating it (unset) if new. Must be called with the registry lock held.
+Series &find_series(Registry &reg, const std::string &name, const std::string &help, const std::string &labels,
+                    Type type) {
+    Family &family = reg.families.try_emplace(name, Family{type, help, {}}).first->second;
+    assert(family.type == type && "Metric registered with different types");
+    for (auto &series : family.series) {
+        if (series->labels == labels) {
+            return *series;
+        }
+    }
+    family.series.push_back(std::make_unique<Series>());
+    family.series.back()->labels = labels;
+    return *family.series.back();
+}
+
+// Series name with its labels, plus an extra label if given
+std::string series_name(const std::string &name, const std::string &labels, const std::string &extra = "") {
+    if (labels.empty() && extra.empty()) {
+        return name;
+    }
+    return name + "{" + labels + (labels.empty() || extra.empty() ? "" : ",") + extra + "}";
+}
+
+}    // namespace
+
+Histogram::Histogram(std::vector<int64_t> bounds)
+    : bounds_(std::move(bounds)), buckets_(new std::atomic<int64_t>[bounds_.size() + 1]) {
+    assert(std::is_sorted(bounds_.begin(), bounds_.end()));
+    for (std::size_t i = 0; i <= bounds_.size(); ++i) {
+        buckets_[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+std::vector<int64_t> exponential_bounds(int64_t start, int64_t factor, int count) {
+    assert(start > 0 && factor >= 2 && count > 0);
+    std::vector<int64_t> bounds;
+    for (int64_t bound = start; (int)bounds.size() < count; bound *= factor) {
+        bounds.push_back(bound);
+    }
+    return bounds;
+}
+
+Counter &counter(const std::string &name, const std::string &help, const std::string &labels) {
+    Registry &reg = registry();
+    std::unique_lock<std::mutex> lock(reg.m);
+    Series &series = find_series(reg, name, help, labels, Type::kCounter);
+    if (!series.counter) {
+        series.counter = std::make_unique<Counter>();
+    }
+    return *series.counter;
+}
+
+Gauge &gauge(const std::string &name, const std::string &help, const std::string &labels) {
+    Registry &reg = registry();
+    std::unique_lock<std::mutex> lock(reg.m);
+    Series &series = find_series(reg, name, help, labels, Type::kGauge);
+    if (!series.gauge) {
+        series.gauge = std::make_unique<Gauge>();
+    }
+    return *series.gauge;
+}
+
+Histogram &histogram(const std::string &name, const std::string &help, const std::vector<int64_t> &bounds,
+                     const std::string &labels) {
+    Registry &reg = registry();
+    std::unique_lock<std::mutex> lock(reg.m);
+    Series &series = find_series(reg, name, help, labels, Type::kHistogram);
+    if (!series.histogram) {
+        series.histogram = std::make_unique<Histogram>(bounds);
+    }
+    return *series.histogram;
+}
+
+const std::string &thread_label() {
+    thread_local std::string label;
+    if (label.empty()) {
+        Registry &reg = registry();
+        std::unique_lock<std::mutex> lock(reg.m);
+        label = "thread=\"" + std::to_string(reg.num_threads++) + "\"";
+    }
+    return label;
+}
+
+std::string prometheus_text() {
+    Registry &reg = registry();
+    std::unique_lock<std::mutex> lock(reg.m);
+    std::ostringstream out;
+    for (const auto &[name, family] : reg.families) {
+        static const char *type_names[] = {"counter", "gauge", "histogram"};
+        out << "# HELP " << name << " " << family.help << "\n";
+        out << "# TYPE " << name << " " << type_names[(int)family.type] << "\n";
+        for (const auto &series : family.series) {
+            switch (family.type) {
+                case Type::kCounter:
+                    out << series_name(name, series->labels) << " " << series->counter->value() << "\n";
+                    break;
+                case Type::kGauge:
+                    out << series_name(name, series->labels) << " " << series->gauge->value() << "\n";
+                    break;
+                case Type::kHistogram: {
+                    // Buckets are exported cumulatively, as the format expects
+                    const Histogram &histogram = *series->histogram;
+                    int64_t count = 0;
+                    for (int i = 0; i <= (int)histogram.bounds().size(); ++i) {
+                        count += histogram.bucket(i);
+                        const std::string le =
+                            i < (int)histogram.bounds().size() ? std::to_string(histogram.bounds()[i]) : "+Inf";
+                        out << series_name(name + "_bucket", series->labels, "le=\"" + le + "\"") << " " << count
+                            << "\n";
+                    }
+                    out << series_name(name + "_sum", series->labels) << " " << histogram.sum() << "\n";
+                    out << series_name(name + "_count", series->labels) << " " << count << "\n";
+                    break;
+                }
+            }
+        }
+    }
+    return out.str();
+}
+
+bool write_prometheus(const std::string &path) {
+    const std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream out(tmp_path);
+        if (!out) {
+            return false;
+        }
+        out << prometheus_text();
+        if (!out) {
+            return false;
+        }
+    }
+    return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+PeriodicWriter::PeriodicWriter(std::string path, std::chrono::milliseconds interval)
+    : path_(std::move(path)), interval_(interval) {
+    thread_ = std::thread([this]() {
+        std::unique_lock<std::mutex> lock(m_);
+        while (!cv_.wait_for(lock, interval_, [this]() { return stop_; })) {
+            write_prometheus(path_);
+        }
+        write_prometheus(path_);
+    });
+}
+
+PeriodicWriter::~PeriodicWriter() {
+    {
+        std::unique_lock<std::mutex> lock(m_);
+        stop_ = true;
+        cv_.notify_all();
+    }
+    thread_.join();
+}
+
+}    // namespace metrics
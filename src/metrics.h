@@ -0,0 +1,158 @@
+// File: metrics.h
+// Description: Process wide counters, gauges and histograms, exportable in the Prometheus text format
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Metrics are registered once by name (and optional labels) and live for the rest of the process, so callers keep a
+// reference to them. Updating a metric is a relaxed atomic add, all aggregation happens when the text is exported.
+namespace metrics {
+
+// Monotonically increasing count
+class Counter {
+public:
+    void add(int64_t n = 1) {
+        value_.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    int64_t value() const {
+        return value_.load(std::memory_order_relaxed);
+    }
+
+private:
+    alignas(64) std::atomic<int64_t> value_{0};    // Own cache line, as counters are written from many threads
+};
+
+// Last set value
+class Gauge {
+public:
+    void set(int64_t value) {
+        value_.store(value, std::memory_order_relaxed);
+    }
+
+    int64_t value() const {
+        return value_.load(std::memory_order_relaxed);
+    }
+
+private:
+    alignas(64) std::atomic<int64_t> value_{0};
+};
+
+// Distribution of integer observations (sizes, microseconds) over fixed buckets
+class Histogram {
+public:
+    /**
+     * @param bounds Inclusive upper bound of each bucket in increasing order, values above the last go in +Inf
+     */
+    explicit Histogram(std::vector<int64_t> bounds);
+
+    void observe(int64_t value) {
+        const std::size_t i = std::lower_bound(bounds_.begin(), bounds_.end(), value) - bounds_.begin();
+        buckets_[i].fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    const std::vector<int64_t> &bounds() const {
+        return bounds_;
+    }
+
+    // Number of observations in bucket i alone (not cumulative), bucket bounds().size() is +Inf
+    int64_t bucket(int i) const {
+        return buckets_[i].load(std::memory_order_relaxed);
+    }
+
+    int64_t sum() const {
+        return sum_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::vector<int64_t> bounds_;
+    std::unique_ptr<std::atomic<int64_t>[]> buckets_;
+    std::atomic<int64_t> sum_{0};
+};
+
+/**
+ * Bucket bounds growing by a constant factor.
+ * @param start First bound
+ * @param factor Ratio between neighbouring bounds, at least 2
+ * @param count Number of bounds
+ * @return The bounds
+ */
+std::vector<int64_t> exponential_bounds(int64_t start, int64_t factor, int count);
+
+/**
+ * Find or register a counter.
+ * @param name Metric name, shared by all label sets of the metric
+ * @param help Description, taken from the first registration of the name
+ * @param labels Prometheus label set without the braces (name="value",...), empty for none
+ * @return The counter, valid for the rest of the process
+ */
+Counter &counter(const std::string &name, const std::string &help, const std::string &labels = "");
+
+// Find or register a gauge, as for counter()
+Gauge &gauge(const std::string &name, const std::string &help, const std::string &labels = "");
+
+// Find or register a histogram, as for counter(). The bounds are taken from the first registration of the label set.
+Histogram &histogram(const std::string &name, const std::string &help, const std::vector<int64_t> &bounds,
+                     const std::string &labels = "");
+
+/**
+ * Label set identifying the calling thread, for metrics kept per thread.
+ * @return thread="<index>", where threads are numbered in the order they first call this
+ */
+const std::string &thread_label();
+
+/**
+ * All registered metrics in the Prometheus text exposition format.
+ * @return The text
+ */
+std::string prometheus_text();
+
+/**
+ * Write prometheus_text() to a file, replacing it atomically so that readers never see a partial write.
+ * @param path File to write to, in the format read by the node exporter textfile collector
+ * @return True if the file was written, false otherwise
+ */
+bool write_prometheus(const std::string &path);
+
+// Rewrites the metrics file on a background thread until destroyed, then writes it a final time
+class PeriodicWriter {
+public:
+    /**
+     * @param path File to write to, see write_prometheus()
+     * @param interval Time between writes
+     */
+    PeriodicWriter(std::string path, std::chrono::milliseconds interval);
+    ~PeriodicWriter();
+
+    PeriodicWriter(const PeriodicWriter &) = delete;
+    PeriodicWriter &operator=(const PeriodicWriter &) = delete;
+
+private:
+    std::string path_;
+    std::chrono::milliseconds interval_;
+    std::mutex m_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+    std::thread thread_;
+};
+
+// Microseconds between two points of the steady clock, as observed by the latency histograms
+inline int64_t micros_between(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+}
+
+}    // namespace metrics
+
+#endif    // METRICS_H_
@@ -1,9 +1,33 @@
 #include "model.h"
 
+#include <c10/core/InferenceMode.h>
+#include <c10/cuda/CUDAGraphsC10Utils.h>
+#include <c10/cuda/CUDAGuard.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
 #include <iostream>
 
+#include "trace.h"
 #include "types.h"
 
+namespace {
+// Kernels launch asynchronously, so when tracing the stream is waited on at the end of each stage to attribute the
+// device time to the stage which launched it.
+void trace_stage_sync(const torch::Tensor &tensor) {
+#ifdef ENABLE_TRACING
+    // Syncing is not allowed while capturing a CUDA graph
+    if (trace::enabled() && tensor.is_cuda() &&
+        c10::cuda::currentStreamCaptureStatusMayInitCtx() == c10::cuda::CaptureStatus::None) {
+        c10::cuda::getCurrentCUDAStream().synchronize();
+    }
+#else
+    (void)tensor;
+#endif
+}
+}    // namespace
+
 // Create a conv1x1 layer using pytorch defaults
 torch::nn::Conv2dOptions conv1x1(int in_channels, int out_channels, int groups) {
     return torch::nn::Conv2dOptions(in_channels, out_channels, 1)
@@ -31,6 +55,15 @@ torch::nn::BatchNorm2dOptions bn(int num_filters) {
     return torch::nn::BatchNorm2dOptions(num_filters).eps(0.0001).momentum(0.01).affine(true).track_running_stats(true);
 }
 
+// Fold the running statistics and affine transform of an eval mode batch norm into the conv before it
+void fold_batchnorm(torch::nn::Conv2d &conv, torch::nn::BatchNorm2d &batch_norm) {
+    assert(conv->options.bias());    // All convs followed by a batch norm are created with a bias
+    torch::NoGradGuard no_grad;
+    torch::Tensor scale = batch_norm->weight / torch::sqrt(batch_norm->running_var + batch_norm->options.eps());
+    conv->weight.mul_(scale.view({-1, 1, 1, 1}));
+    conv->bias.sub_(batch_norm->running_mean).mul_(scale).add_(batch_norm->bias);
+}
+
 // ------------------------------- MLP Network ------------------------------
 // MLP
 MLPImpl::MLPImpl(int input_size, const std::vector<int> &layer_sizes, int output_size, const std::string &name) {
@@ -71,20 +104,27 @@ ResidualBlockImpl::ResidualBlockImpl(int num_channels, int layer_num, bool use_b
 }
 
 torch::Tensor ResidualBlockImpl::forward(torch::Tensor x) {
-    torch::Tensor residual = x.clone();
+    // x is only read by conv1, so it can be used directly as the residual
     torch::Tensor output = conv1(x);
     if (use_batchnorm) {
         output = batch_norm1(output);
     }
-    output = torch::relu(output);
+    output.relu_();
     output = conv2(output);
     if (use_batchnorm) {
         output = batch_norm2(output);
     }
-    output += residual;
-    output = torch::relu(output);
+    output.add_(x).relu_();
     return output;
 }
+
+void ResidualBlockImpl::fuse_batchnorm() {
+    if (use_batchnorm) {
+        fold_batchnorm(conv1, batch_norm1);
+        fold_batchnorm(conv2, batch_norm2);
+        use_batchnorm = false;
+    }
+}
 // ------------------------------ ResNet Block ------------------------------
 
 // ------------------------------ ResNet Head -------------------------------
@@ -105,10 +145,17 @@ torch::Tensor ResidualHeadImpl::forward(torch::Tensor x) {
     if (use_batchnorm) {
         output = batch_norm(output);
     }
-    output = torch::relu(output);
+    output.relu_();
     return output;
 }
 
+void ResidualHeadImpl::fuse_batchnorm() {
+    if (use_batchnorm) {
+        fold_batchnorm(conv, batch_norm);
+        use_batchnorm = false;
+    }
+}
+
 // ------------------------------ ResNet Head -------------------------------
 
 TwoHeadedConvNetImpl::TwoHeadedConvNetImpl(const ObservationShape &observation_shape, int num_actions,
@@ -140,106 +187,276 @@ TwoHeadedConvNetImpl::TwoHeadedConvNetImpl(const ObservationShape &observation_s
 }
 
 TwoHeadedConvNetOutput TwoHeadedConvNetImpl::forward(torch::Tensor x) {
+    torch::Tensor output;
     {
-        std::stringstream ss;
-        ss << "\t Pre resnet head" << std::this_thread::get_id() << "\n";
-        std::cout << ss.str() << std::flush;
-    }
-    torch::Tensor output = resnet_head_->forward(x);
-    {
-        std::stringstream ss;
-        ss << "\t Post resnet head" << std::this_thread::get_id() << "\n";
-        std::cout << ss.str() << std::flush;
+        TRACE_SCOPE("resnet_head");
+        output = resnet_head_->forward(x);
+        trace_stage_sync(output);
     }
     // ResNet body
-    for (int i = 0; i < (int)resnet_layers_->size(); ++i) {
-        output = resnet_layers_[i]->as<ResidualBlock>()->forward(output);
-    }
     {
-        std::stringstream ss;
-        ss << "\t Post resnet body" << std::this_thread::get_id() << "\n";
-        std::cout << ss.str() << std::flush;
+        TRACE_SCOPE("resnet_body");
+        for (int i = 0; i < (int)resnet_layers_->size(); ++i) {
+            output = resnet_layers_[i]->as<ResidualBlock>()->forward(output);
+        }
+        trace_stage_sync(output);
     }
     // Reduce and mlp
+    TRACE_SCOPE("output_heads");
     torch::Tensor logits = conv1x1_policy_->forward(output);
     torch::Tensor heuristic = conv1x1_heuristic_->forward(output);
-    logits = logits.view({-1, policy_mlp_input_size_});
-    heuristic = heuristic.view({-1, heuristic_mlp_input_size_});
+    // Flattened in NCHW order as the mlps expect, copying if the convs ran channels last (where view would fail)
+    logits = logits.flatten(1);
+    heuristic = heuristic.flatten(1);
+    assert(logits.size(1) == policy_mlp_input_size_ && heuristic.size(1) == heuristic_mlp_input_size_);
 
-    logits = policy_mlp_->forward(logits);
+    // Outputs are always full precision regardless of the precision the network runs in
+    logits = policy_mlp_->forward(logits).to(torch::kFloat);
     torch::Tensor policy = torch::softmax(logits, 1);
     torch::Tensor log_policy = torch::log_softmax(logits, 1);
-    heuristic = heuristic_mlp_->forward(heuristic);
+    heuristic = heuristic_mlp_->forward(heuristic).to(torch::kFloat);
+    trace_stage_sync(heuristic);
     return {logits, policy, log_policy, heuristic};
 }
 
-std::vector<InferenceOutput> TwoHeadedConvNetWrapper::Inference(std::vector<Observation> &inputs) {
-    int batch_size = (int)inputs.size();
+void TwoHeadedConvNetImpl::fuse_batchnorm() {
+    resnet_head_->fuse_batchnorm();
+    for (int i = 0; i < (int)resnet_layers_->size(); ++i) {
+        resnet_layers_[i]->as<ResidualBlock>()->fuse_batchnorm();
+    }
+}
 
-    {
-        std::stringstream ss;
-        ss << "Starting Inference " << batch_size << " " << std::this_thread::get_id() << "\n";
-        std::cout << ss.str() << std::flush;
+InferenceBatchOutput TwoHeadedConvNetWrapper::Inference(const ObservationBatch &inputs) {
+    TRACE_SCOPE("inference");
+    assert(inputs.row_size() == input_flat_size_);
+    int batch_size = inputs.size();
+
+    // Launch all work for this replica on its own stream
+    std::optional<c10::cuda::CUDAStreamGuard> stream_guard;
+    if (stream_) {
+        stream_guard.emplace(*stream_);
     }
 
-    // Create tensor from raw flat array
-    // torch::from_blob requires a pointer to non-const and doesn't take ownership
-    auto options = torch::TensorOptions().dtype(torch::kFloat);
-    torch::Tensor input_observations = torch::empty({batch_size, input_flat_size_}, options);
-    for (int i = 0; i < batch_size; ++i) {
-        input_observations[i] = torch::from_blob(inputs[i].data(), {input_flat_size_}, options).clone();
+    // Model is already in eval mode, inference mode also skips autograd and version counter bookkeeping
+    c10::InferenceMode inference_mode;
+
+    // Copy the packed observations into the staging buffer, then copy the whole batch to the device at once.
+    // The copy is async w.r.t. the host, but is ordered on this replica's stream before the forward pass, and the
+    // blocking output copy at the end guarantees it has finished before the buffer is reused.
+    CapturedGraph *graph = find_graph(batch_size);
+    torch::Tensor input_observations;
+    {
+        TRACE_SCOPE("h2d");
+        reserve_staging(staging_, batch_size, input_flat_size_, torch::kFloat);
+        std::memcpy(staging_.data_ptr<float>(), inputs.data(), sizeof(float) * batch_size * input_flat_size_);
+
+        // Reshape to expected size for network (batch_size, flat) -> (batch_size, c, h, w)
+        torch::Tensor host_observations =
+            staging_.narrow(0, 0, batch_size).view({batch_size, obs_shape.c, obs_shape.h, obs_shape.w});
+        if (graph) {
+            // Rows past batch_size are left as they were, they are computed on but never read back
+            graph->input.narrow(0, 0, batch_size).copy_(host_observations, /*non_blocking=*/true);
+            input_observations = graph->input;
+        } else {
+            input_observations = to_model_input(host_observations);
+        }
+        trace_stage_sync(input_observations);
     }
 
-    // Reshape to expected size for network (batch_size, flat) -> (batch_size, c, h, w)
-    input_observations = input_observations.to(torch_device);
-    input_observations = input_observations.reshape(
-        {batch_size, obs_shape.c, obs_shape.h, obs_shape.w});
+    return run_forward(graph, input_observations, batch_size);
+}
 
-    // Put model in eval mode for inference + scoped no_grad
-    model.ptr()->eval();
-    torch::NoGradGuard no_grad;
+InferenceBatchOutput TwoHeadedConvNetWrapper::Inference(const CellTypeBatch &inputs) {
+    TRACE_SCOPE("inference");
+    const int cells = obs_shape.h * obs_shape.w;
+    assert(inputs.row_size() == cells);
+    int batch_size = inputs.size();
+
+    std::optional<c10::cuda::CUDAStreamGuard> stream_guard;
+    if (stream_) {
+        stream_guard.emplace(*stream_);
+    }
+    c10::InferenceMode inference_mode;
 
+    // Only the cell types are sent over, 1 byte per cell rather than 4 bytes per cell per channel, and are expanded
+    // to one-hot planes on the device. Ordering w.r.t. reuse of the staging buffer is the same as the float path.
+    CapturedGraph *graph = find_graph(batch_size);
+    torch::Tensor input_observations;
     {
-        std::stringstream ss;
-        ss << "Tensors on device " << std::this_thread::get_id() << "\n";
-        std::cout << ss.str() << std::flush;
+        TRACE_SCOPE("h2d");
+        reserve_staging(cell_staging_, batch_size, cells, torch::kChar);
+        std::memcpy(cell_staging_.data_ptr<int8_t>(), inputs.data(), sizeof(int8_t) * batch_size * cells);
+        torch::Tensor device_cells =
+            cell_staging_.narrow(0, 0, batch_size).to(torch_device, /*non_blocking=*/true);
+        torch::Tensor expanded = expand_cell_types(device_cells);
+        if (graph) {
+            graph->input.narrow(0, 0, batch_size).copy_(expanded);
+            input_observations = graph->input;
+        } else {
+            input_observations = expanded;
+        }
+        trace_stage_sync(input_observations);
     }
 
+    return run_forward(graph, input_observations, batch_size);
+}
+
+InferenceBatchOutput TwoHeadedConvNetWrapper::run_forward(CapturedGraph *graph, const torch::Tensor &input,
+                                                          int batch_size) {
     // Run inference
-    TwoHeadedConvNetOutput inference_output = model->forward(input_observations);
+    torch::Tensor packed;
+    if (graph) {
+        TRACE_SCOPE("graph_replay");
+        graph->graph.replay();
+        packed = graph->output.narrow(0, 0, batch_size);
+        trace_stage_sync(packed);
+    } else {
+        packed = forward_packed(input);
+    }
 
-    {
-        std::stringstream ss;
-        ss << "Model forward " << std::this_thread::get_id() << "\n";
-        std::cout << ss.str() << std::flush;
-    }
-
-    // Create output
-    torch::Tensor logits_output = inference_output.logits.to(torch::kDouble).to(torch::kCPU);
-    torch::Tensor policy_output = inference_output.policy.to(torch::kDouble).to(torch::kCPU);
-    torch::Tensor log_policy_output = inference_output.log_policy.to(torch::kDouble).to(torch::kCPU);
-    torch::Tensor heuristic_output = inference_output.heuristic.to(torch::kDouble).to(torch::kCPU);
-    std::vector<InferenceOutput> outputs;
-    outputs.reserve(batch_size);
-    for (int i = 0; i < batch_size; ++i) {
-        std::vector<double> logits(logits_output[i].data_ptr<double>(),
-                                   logits_output[i].data_ptr<double>() + logits_output[i].numel());
-        std::vector<double> policy(policy_output[i].data_ptr<double>(),
-                                   policy_output[i].data_ptr<double>() + policy_output[i].numel());
-        std::vector<double> log_policy(log_policy_output[i].data_ptr<double>(),
-                                       log_policy_output[i].data_ptr<double>() + log_policy_output[i].numel());
-        outputs.push_back({logits, policy, log_policy, heuristic_output[i].item<double>()});
+    TRACE_SCOPE("d2h");
+    packed = packed.to(torch::kCPU).contiguous();
+
+    // Buffer keeps the host tensor alive for as long as any view into it exists
+    std::shared_ptr<const float> buffer(packed.data_ptr<float>(), [packed](const float *) {});
+    InferenceBatchOutput outputs(std::move(buffer), batch_size, num_actions_, output_logits_);
+    return outputs;
+}
+
+torch::Tensor TwoHeadedConvNetWrapper::expand_cell_types(const torch::Tensor &device_cells) const {
+    const int batch_size = device_cells.size(0);
+    // (batch_size, h * w) -> (batch_size, h, w, c), which viewed as (batch_size, c, h, w) is already channels last
+    torch::Tensor one_hot = torch::one_hot(device_cells.to(torch::kLong), obs_shape.c)
+                                .to(model_dtype_)
+                                .view({batch_size, obs_shape.h, obs_shape.w, obs_shape.c})
+                                .permute({0, 3, 1, 2});
+    if (engine_options_.channels_last) {
+        return one_hot;
     }
+    return one_hot.contiguous();
+}
 
-    {
-        std::stringstream ss;
-        ss << "Sending inference " << std::this_thread::get_id() << "\n";
-        std::cout << ss.str() << std::flush;
+torch::Tensor TwoHeadedConvNetWrapper::to_model_input(const torch::Tensor &host_observations) const {
+    torch::Tensor input = host_observations.to(torch_device, /*non_blocking=*/true);
+    if (model_dtype_ != torch::kFloat) {
+        input = input.to(model_dtype_);
+    }
+    if (engine_options_.channels_last) {
+        input = input.contiguous(torch::MemoryFormat::ChannelsLast);
+    }
+    return input;
+}
+
+torch::Tensor TwoHeadedConvNetWrapper::forward_packed(const torch::Tensor &input) {
+    TwoHeadedConvNetOutput inference_output = model->forward(input);
+    // Pack all outputs into one contiguous float buffer on device, so that only a single copy back is needed
+    std::vector<torch::Tensor> packed_outputs{inference_output.policy, inference_output.log_policy,
+                                              inference_output.heuristic};
+    if (output_logits_) {
+        packed_outputs.push_back(inference_output.logits);
+    }
+    return torch::cat(packed_outputs, 1);
+}
+
+TwoHeadedConvNetWrapper::CapturedGraph *TwoHeadedConvNetWrapper::find_graph(int batch_size) {
+    // Graphs are sorted by batch size, so the first that fits wastes the least padding
+    for (auto &graph : graphs_) {
+        if (graph->batch_size >= batch_size) {
+            return graph.get();
+        }
+    }
+    return nullptr;
+}
+
+void TwoHeadedConvNetWrapper::capture_graphs() {
+    if (!torch_device.is_cuda() || engine_options_.cuda_graph_batch_sizes.empty()) {
+        return;
+    }
+    std::vector<int> batch_sizes = engine_options_.cuda_graph_batch_sizes;
+    std::sort(batch_sizes.begin(), batch_sizes.end());
+    batch_sizes.erase(std::unique(batch_sizes.begin(), batch_sizes.end()), batch_sizes.end());
+
+    // Capture has to happen on a non-default stream
+    c10::cuda::CUDAStreamGuard stream_guard(*stream_);
+    c10::InferenceMode inference_mode;
+    for (int batch_size : batch_sizes) {
+        auto graph = std::make_unique<CapturedGraph>();
+        graph->batch_size = batch_size;
+        graph->input = to_model_input(torch::zeros({batch_size, obs_shape.c, obs_shape.h, obs_shape.w}));
+
+        // Warmup outside of capture so that library handles and workspaces get allocated
+        for (int i = 0; i < 3; ++i) {
+            forward_packed(graph->input);
+        }
+        stream_->synchronize();
+
+        graph->graph.capture_begin();
+        graph->output = forward_packed(graph->input);
+        graph->graph.capture_end();
+        stream_->synchronize();
+        graphs_.push_back(std::move(graph));
     }
-    return outputs;
 }
 
+void TwoHeadedConvNetWrapper::prepare_engine() {
+    model->eval();
+    if (engine_options_.freeze) {
+        model->fuse_batchnorm();
+    }
+    switch (engine_options_.precision) {
+        case InferencePrecision::kFloat32:
+            model_dtype_ = torch::kFloat;
+            break;
+        case InferencePrecision::kFloat16:
+            model_dtype_ = torch::kHalf;
+            break;
+        case InferencePrecision::kBFloat16:
+            model_dtype_ = torch::kBFloat16;
+            break;
+    }
+    if (model_dtype_ != torch::kFloat) {
+        model->to(model_dtype_);
+    }
+    if (engine_options_.channels_last) {
+        torch::NoGradGuard no_grad;
+        for (auto &parameter : model->parameters(true)) {
+            if (parameter.dim() == 4) {
+                parameter.set_data(parameter.contiguous(torch::MemoryFormat::ChannelsLast));
+            }
+        }
+    }
+}
+
+void TwoHeadedConvNetWrapper::reserve_staging(torch::Tensor &staging, int batch_size, int row_size,
+                                              torch::ScalarType dtype) {
+    if (staging.defined() && staging.size(0) >= batch_size) {
+        return;
+    }
+    int capacity = staging.defined() ? (int)staging.size(0) : 1;
+    while (capacity < batch_size) {
+        capacity *= 2;
+    }
+    // Pinned memory is only available (and only useful) when copying to a CUDA device
+    auto options = torch::TensorOptions().dtype(dtype).pinned_memory(torch_device.is_cuda());
+    staging = torch::empty({capacity, row_size}, options);
+}
 
 void TwoHeadedConvNetWrapper::print() const {
     std::cout << model << std::endl;
+}
+
+void TwoHeadedConvNetWrapper::copy_weights_from(const TwoHeadedConvNetWrapper &other) {
+    torch::NoGradGuard no_grad;
+    auto other_parameters = other.model->named_parameters(true);
+    for (auto &parameter : model->named_parameters(true)) {
+        parameter.value().copy_(other_parameters[parameter.key()]);
+    }
+    auto other_buffers = other.model->named_buffers(true);
+    for (auto &buffer : model->named_buffers(true)) {
+        buffer.value().copy_(other_buffers[buffer.key()]);
+    }
+    // Copies are queued on the default stream, which the replica streams don't wait on
+    if (torch_device.is_cuda()) {
+        torch::cuda::synchronize(torch_device.index());
+    }
 }   
\ No newline at end of file
@@ -3,9 +3,13 @@
 #ifndef MODELS_H_
 #define MODELS_H_
 
+#include <ATen/cuda/CUDAGraph.h>
+#include <c10/cuda/CUDAStream.h>
 #include <torch/nn/modules/container/any.h>
 #include <torch/torch.h>
 
+#include <memory>
+#include <optional>
 #include <string>
 #include <vector>
 
@@ -44,6 +48,8 @@ public:
      */
     ResidualBlockImpl(int num_channels, int layer_num, bool use_batchnorm, int groups = 1);
     torch::Tensor forward(torch::Tensor x);
+    // Fold the batch norm running statistics into the preceding convs, only valid for inference
+    void fuse_batchnorm();
 
 private:
     torch::nn::Conv2d conv1;
@@ -66,6 +72,8 @@ public:
      */
     ResidualHeadImpl(int input_channels, int output_channels, bool use_batchnorm, const std::string &name_prefix = "");
     torch::Tensor forward(torch::Tensor x);
+    // Fold the batch norm running statistics into the preceding conv, only valid for inference
+    void fuse_batchnorm();
     // Get the observation shape the network outputs given the input
     static ObservationShape encoded_state_shape(ObservationShape observation_shape);
 
@@ -90,6 +98,8 @@ public:
     TwoHeadedConvNetImpl(const ObservationShape &observation_shape, int num_actions, int resnet_channels=128, int resnet_blocks=8,
                          int policy_reduced_channels=2, int heuristic_reduced_channels=2, bool use_batch_norm=false);
     TwoHeadedConvNetOutput forward(torch::Tensor x);
+    // Fold all batch norm layers into their preceding convs, only valid for inference
+    void fuse_batchnorm();
 
 private:
     int input_channels_;
@@ -109,24 +119,106 @@ private:
 };
 TORCH_MODULE(TwoHeadedConvNet);
 
+// Numeric precision the inference engine runs the network in
+enum class InferencePrecision {
+    kFloat32,
+    kFloat16,
+    kBFloat16,
+};
+
+// How the network is prepared for inference
+struct InferenceEngineOptions {
+    bool freeze = false;                                            // Fold batch norm into the convs (when used)
+    InferencePrecision precision = InferencePrecision::kFloat32;    // Precision of weights and activations
+    bool channels_last = false;                                     // Use NHWC memory layout for convs
+    std::vector<int> cuda_graph_batch_sizes;                        // Batch size buckets to capture CUDA graphs for
+};
+
+// Wraps a model replica on a single device
+// CUDA replicas run on their own stream from the pool, so several replicas can share a device
 class TwoHeadedConvNetWrapper {
 public:
-    TwoHeadedConvNetWrapper(const ObservationShape observation_shape, int num_actions, const std::string& device="cuda:0")
+    TwoHeadedConvNetWrapper(const ObservationShape observation_shape, int num_actions, const std::string& device="cuda:0",
+                            int max_batch_size = 1024, bool output_logits = false,
+                            const InferenceEngineOptions& engine_options = InferenceEngineOptions())
         : obs_shape(observation_shape), input_flat_size_(observation_shape.c * observation_shape.h * observation_shape.w),
-          num_actions_(num_actions),
+          num_actions_(num_actions), output_logits_(output_logits), engine_options_(engine_options),
           model(observation_shape, num_actions), torch_device(device){
             model.ptr()->to(torch_device);
+            if (torch_device.is_cuda()) {
+                stream_ = c10::cuda::getStreamFromPool(false, torch_device.index());
+            }
+            prepare_engine();
+            reserve_staging(staging_, max_batch_size, input_flat_size_, torch::kFloat);
+            capture_graphs();
           };
 
-    std::vector<InferenceOutput> Inference(std::vector<Observation> &inputs);
+    /**
+     * Run inference on a batch of observations.
+     * @param inputs Observations, each of the size given by the observation shape
+     * @return Packed predictions for each observation, in the same order
+     */
+    InferenceBatchOutput Inference(const ObservationBatch &inputs);
+
+    /**
+     * Run inference on a batch of visible cell type grids, which are one-hot encoded on the device.
+     * @param inputs Cell types, each row of size h * w with values less than the observation channels
+     * @return Packed predictions for each grid, in the same order
+     */
+    InferenceBatchOutput Inference(const CellTypeBatch &inputs);
     void print() const;
 
+    /**
+     * Copy the parameters and buffers of another replica into this one.
+     * @param other Replica of the same architecture, can be on a different device
+     */
+    void copy_weights_from(const TwoHeadedConvNetWrapper &other);
+
 private:
+    // Forward pass replayed from a graph captured for a fixed (padded) batch size
+    struct CapturedGraph {
+        int batch_size;
+        at::cuda::CUDAGraph graph;
+        torch::Tensor input;     // Static input the graph reads from
+        torch::Tensor output;    // Static packed output the graph writes to
+    };
+
+    // Put the model in eval mode and apply the engine options, done once at construction
+    void prepare_engine();
+
+    // Capture a graph for each of the requested batch size buckets, only for CUDA devices
+    void capture_graphs();
+
+    // Smallest captured graph which fits the batch, or nullptr if none fit
+    CapturedGraph *find_graph(int batch_size);
+
+    // Move a host batch to the device, in the precision and layout the model expects
+    torch::Tensor to_model_input(const torch::Tensor &host_observations) const;
+
+    // Expand (batch_size, h * w) cell types on the device to one-hot (batch_size, c, h, w) model input
+    torch::Tensor expand_cell_types(const torch::Tensor &device_cells) const;
+
+    // Forward the device input, through the graph if given, and copy the packed outputs back to the host
+    InferenceBatchOutput run_forward(CapturedGraph *graph, const torch::Tensor &input, int batch_size);
+
+    // Run the model and pack the outputs into [policy, log_policy, heuristic, logits (optional)] rows
+    torch::Tensor forward_packed(const torch::Tensor &input);
+
+    // Grow a host staging buffer so that it holds at least batch_size rows
+    void reserve_staging(torch::Tensor &staging, int batch_size, int row_size, torch::ScalarType dtype);
+
     ObservationShape obs_shape;
     int input_flat_size_;
     int num_actions_;
+    bool output_logits_;    // Flag to also copy back the raw logits
+    InferenceEngineOptions engine_options_;
+    torch::ScalarType model_dtype_ = torch::kFloat;
     TwoHeadedConvNet model;
     torch::Device torch_device;
+    std::optional<c10::cuda::CUDAStream> stream_;           // Stream this replica runs on, if on a CUDA device
+    torch::Tensor staging_;                                 // Reusable (pinned if on CUDA) host buffer for input batches
+    torch::Tensor cell_staging_;                            // As above, for cell type batches
+    std::vector<std::unique_ptr<CapturedGraph>> graphs_;    // Captured graphs, sorted by batch size
 };
 
 #endif    // MODELS_H_
@@ -1,71 +1,337 @@
 #ifndef MODEL_EVALUATOR_H_
 #define MODEL_EVALUATOR_H_
 
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <exception>
+#include <functional>
 #include <future>
 #include <memory>
+#include <optional>
+#include <stdexcept>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include "inference_cache.h"
+#include "metrics.h"
 #include "model.h"
+#include "mpmc_queue.h"
 #include "queue.h"
 #include "types.h"
 
+// Queue the evaluator takes requests from, lock-free when built with LOCKFREE_INFERENCE_QUEUE
+#ifdef LOCKFREE_INFERENCE_QUEUE
+template <typename T>
+using InferenceQueue = MPMCQueue<T>;
+#else
+template <typename T>
+using InferenceQueue = ThreadedQueue<T>;
+#endif
+
+// Options for how the evaluator groups incoming queries and where the model replicas live
+struct ModelEvaluatorOptions {
+    int max_batch_size = 1024;                     // Max observations merged into a single forward pass
+    std::chrono::microseconds max_wait{0};         // Max time to wait for more queries once one has arrived
+    std::vector<std::string> devices{"cuda:0"};    // Devices to place model replicas on
+    int replicas_per_device = 1;                   // Replicas per device, each runs on its own CUDA stream
+    bool output_logits = false;                    // Flag to also return the raw policy logits
+    InferenceEngineOptions engine;                 // How each replica prepares the network for inference
+    bool compact_observations = false;             // Clients send cell type grids, one-hot encoded on the device
+    int cache_size = 0;                            // Predictions kept for reuse by state hash, 0 to disable
+    int cache_shards = 16;                         // Independently locked shards of the prediction cache
+    int queue_depth = 0;                           // Max requests waiting for a batch, 0 for 4 per search thread
+    std::string name;                              // Labels the metrics as evaluator="<name>", numbered if empty
+};
+
 // Handles threaded queries for the model
+// Queries waiting in the queue are merged into a single forward pass, and the results scattered back.
+// Each model replica has its own runner thread pulling from the shared queue, so the next batch always goes to
+// whichever replica is free first. Every request is answered: requests made once the evaluator is shutting down throw
+// std::runtime_error, and requests still queued when it is destroyed are failed through their error callback.
 class ModelEvaluator {
 public:
-    explicit ModelEvaluator(const ObservationShape observation_shape, int num_actions, int search_threads)
-        : model_wrapper(observation_shape, num_actions), queue_(search_threads * 4) {
-        inference_threads_.emplace_back([this]() { this->InferenceRunner(); });
+    explicit ModelEvaluator(const ObservationShape observation_shape, int num_actions, int search_threads,
+                            const ModelEvaluatorOptions &options = ModelEvaluatorOptions())
+        : options_(options), queue_(options.queue_depth > 0 ? options.queue_depth : search_threads * 4) {
+        assert(!options_.devices.empty() && options_.replicas_per_device > 0);
+        if (options_.cache_size > 0) {
+            cache_ = std::make_unique<InferenceCache>(options_.cache_size, options_.cache_shards);
+        }
+        std::vector<metrics::Counter*> busy_metrics;
+        for (const auto& device : options_.devices) {
+            for (int i = 0; i < options_.replicas_per_device; ++i) {
+                model_wrappers_.push_back(
+                    std::make_unique<TwoHeadedConvNetWrapper>(observation_shape, num_actions, device,
+                                                              options_.max_batch_size, options_.output_logits,
+                                                              options_.engine));
+                // Utilization of a replica (or summed, of a device) is the rate of its busy time
+                busy_metrics.push_back(&metrics::counter(
+                    "inference_busy_us_total", "Time replicas spend running forward passes, in microseconds",
+                    metric_labels_ + ",device=\"" + device + "\",replica=\"" + std::to_string(i) + "\""));
+            }
+        }
+        // All replicas need to compute the same function
+        for (int i = 1; i < (int)model_wrappers_.size(); ++i) {
+            model_wrappers_[i]->copy_weights_from(*model_wrappers_[0]);
+        }
+        for (int i = 0; i < (int)model_wrappers_.size(); ++i) {
+            inference_threads_.emplace_back([this, model = model_wrappers_[i].get(), busy_metric = busy_metrics[i]]() {
+                this->InferenceRunner(*model, *busy_metric);
+            });
+        }
     };
 
     ~ModelEvaluator() {
-        // Clear the incoming queues and stop oustanding threads
+        // Stop outstanding threads, then fail the requests they left in the queue
         stop_token_.stop();
         queue_.BlockNewValues();
-        queue_.Clear();
         for (auto& t : inference_threads_) {
             t.join();
         }
+        while (std::optional<QueueItem> item = queue_.Pop()) {
+            fail(*item);
+        }
+    }
+
+    using InferenceCallback = std::function<void(InferenceBatchOutput)>;
+    using ErrorCallback = std::function<void(std::exception_ptr)>;
+
+    /**
+     * Perform inference for a group of observations by sending to thread runner, blocking until done
+     */
+    InferenceBatchOutput Inference(std::vector<Observation>& inference_inputs) {
+        return Inference(to_batch(inference_inputs));
+    }
+
+    /**
+     * Perform inference for a batch of observations by sending to thread runner, blocking until done
+     */
+    InferenceBatchOutput Inference(ObservationBatch inference_inputs) {
+        std::promise<InferenceBatchOutput> prom;
+        std::future<InferenceBatchOutput> fut = prom.get_future();
+        push(QueueItem{std::move(inference_inputs), {},
+                       [&prom](InferenceBatchOutput output) { prom.set_value(output); },
+                       [&prom](std::exception_ptr error) { prom.set_exception(error); }});
+        return wait_result(fut);
+    }
+
+    /**
+     * Perform inference for a batch of cell type grids by sending to thread runner, blocking until done
+     */
+    InferenceBatchOutput Inference(CellTypeBatch inference_inputs) {
+        std::promise<InferenceBatchOutput> prom;
+        std::future<InferenceBatchOutput> fut = prom.get_future();
+        push(QueueItem{{}, std::move(inference_inputs),
+                       [&prom](InferenceBatchOutput output) { prom.set_value(output); },
+                       [&prom](std::exception_ptr error) { prom.set_exception(error); }});
+        return wait_result(fut);
+    }
+
+    /**
+     * Queue a batch of observations for inference without waiting for the result.
+     * @param inference_inputs Observations to run inference on
+     * @param callback Called with the result on an inference thread, so should be short and thread safe
+     * @param on_error Called instead of callback, on the destroying thread, if the evaluator is destroyed first
+     */
+    void InferenceAsync(ObservationBatch inference_inputs, InferenceCallback callback, ErrorCallback on_error) {
+        push(QueueItem{std::move(inference_inputs), {}, std::move(callback), std::move(on_error)});
     }
 
     /**
-     * Perform inference for a group of observations by sending to thread runner
+     * Queue a batch of cell type grids for inference without waiting for the result.
+     * @param inference_inputs Visible cell types of each board, of size h * w
+     * @param callback Called with the result on an inference thread, so should be short and thread safe
+     * @param on_error Called instead of callback, on the destroying thread, if the evaluator is destroyed first
      */
-    std::vector<InferenceOutput> Inference(std::vector<Observation>& inference_inputs) {
-        std::promise<std::vector<InferenceOutput>> prom;
-        std::future<std::vector<InferenceOutput>> fut = prom.get_future();
-        queue_.Push(QueueItem{inference_inputs, &prom});
-        return fut.get();
+    void InferenceAsync(CellTypeBatch inference_inputs, InferenceCallback callback, ErrorCallback on_error) {
+        push(QueueItem{{}, std::move(inference_inputs), std::move(callback), std::move(on_error)});
+    }
+
+    /**
+     * Queue a batch of observations for inference without waiting for the result.
+     * @param inference_inputs Observations to run inference on
+     * @return Future holding the result once inference is done
+     */
+    std::future<InferenceBatchOutput> InferenceAsync(ObservationBatch inference_inputs) {
+        auto prom = std::make_shared<std::promise<InferenceBatchOutput>>();
+        std::future<InferenceBatchOutput> fut = prom->get_future();
+        InferenceAsync(
+            std::move(inference_inputs), [prom](InferenceBatchOutput output) { prom->set_value(output); },
+            [prom](std::exception_ptr error) { prom->set_exception(error); });
+        return fut;
+    }
+
+    void InferenceAsync(const std::vector<Observation>& inference_inputs, InferenceCallback callback,
+                        ErrorCallback on_error) {
+        InferenceAsync(to_batch(inference_inputs), std::move(callback), std::move(on_error));
+    }
+
+    std::future<InferenceBatchOutput> InferenceAsync(const std::vector<Observation>& inference_inputs) {
+        return InferenceAsync(to_batch(inference_inputs));
+    }
+
+    // Whether clients should send cell type grids rather than full observations
+    bool compact_observations() const {
+        return options_.compact_observations;
+    }
+
+    /**
+     * Cache of predictions shared by all clients of this evaluator, which they look up and fill themselves.
+     * @return The cache, or nullptr if disabled
+     */
+    InferenceCache* cache() const {
+        return cache_.get();
+    }
+
+    /**
+     * Number of requests waiting to be batched, which is approximate while other threads are using the evaluator.
+     * @return Number of queued requests
+     */
+    int queued_requests() {
+        return queue_.Size();
     }
 
     void print() const {
-        model_wrapper.print();
+        model_wrappers_[0]->print();
     }
 
 private:
-    // Runner to perform inference queries if using threading on the model
-    void InferenceRunner() {
+    InferenceBatchOutput wait_result(std::future<InferenceBatchOutput>& fut) {
+        const auto wait_start = std::chrono::steady_clock::now();
+        InferenceBatchOutput output = fut.get();
+        wait_metric_.observe(metrics::micros_between(wait_start, std::chrono::steady_clock::now()));
+        return output;
+    }
+
+    static ObservationBatch to_batch(const std::vector<Observation>& observations) {
+        ObservationBatch batch(observations.empty() ? 0 : (int)observations[0].size(), (int)observations.size());
+        for (const auto& observation : observations) {
+            batch.push_back(observation);
+        }
+        return batch;
+    }
+
+    // Runner to perform inference queries if using threading on the model, one per model replica
+    void InferenceRunner(TwoHeadedConvNetWrapper& model_wrapper, metrics::Counter& busy_metric) {
+        auto item_size = [](const QueueItem& item) { return item.size(); };
+        ObservationBatch batch_inputs;
+        CellTypeBatch batch_cell_types;
+        std::optional<QueueItem> carry;    // Request which didn't fit in the previous batch
         while (!stop_token_.stop_requested()) {
-            std::optional<QueueItem> item = queue_.Pop();
-            if (!item) {
+            std::vector<QueueItem> items =
+                queue_.PopMany(options_.max_batch_size, item_size, options_.max_wait, carry);
+            if (items.empty()) {
                 continue;
             }
-            std::vector<InferenceOutput> outputs = model_wrapper.Inference(item->inputs);
-            item->prom->set_value(outputs);
+            queue_depth_metric_.set(queue_.Size());
+            requests_metric_.add(items.size());
+
+            // Concatenate all queries into one batch per kind of input, normally only one kind is in use
+            batch_inputs.clear();
+            batch_cell_types.clear();
+            for (const auto& item : items) {
+                if (item.is_compact()) {
+                    if (batch_cell_types.empty()) {
+                        batch_cell_types.reset(item.cell_types.row_size());
+                    }
+                    batch_cell_types.append(item.cell_types);
+                } else {
+                    if (batch_inputs.empty()) {
+                        batch_inputs.reset(item.inputs.row_size());
+                    }
+                    batch_inputs.append(item.inputs);
+                }
+            }
+            InferenceBatchOutput outputs;
+            InferenceBatchOutput cell_type_outputs;
+            const auto forward_start = std::chrono::steady_clock::now();
+            if (!batch_inputs.empty()) {
+                outputs = model_wrapper.Inference(batch_inputs);
+            }
+            if (!batch_cell_types.empty()) {
+                cell_type_outputs = model_wrapper.Inference(batch_cell_types);
+            }
+            const int64_t forward_us = metrics::micros_between(forward_start, std::chrono::steady_clock::now());
+            latency_metric_.observe(forward_us);
+            busy_metric.add(forward_us);
+            batch_size_metric_.observe(batch_inputs.size() + batch_cell_types.size());
+
+            // Scatter results back to each query in the order they were concatenated, all sharing the same buffer
+            int offset = 0;
+            int cell_type_offset = 0;
+            for (auto& item : items) {
+                if (item.is_compact()) {
+                    item.callback(cell_type_outputs.slice(cell_type_offset, item.size()));
+                    cell_type_offset += item.size();
+                } else {
+                    item.callback(outputs.slice(offset, item.size()));
+                    offset += item.size();
+                }
+            }
+        }
+        // The request which didn't fit won't be retaken once stopped
+        if (carry) {
+            fail(*carry);
         }
     }
 
-    TwoHeadedConvNetWrapper model_wrapper;
+    ModelEvaluatorOptions options_;
+    std::vector<std::unique_ptr<TwoHeadedConvNetWrapper>> model_wrappers_;    // Model replicas
+    std::unique_ptr<InferenceCache> cache_;                                   // Null unless enabled
 
-    // Struct for holding promised value for inference queries
+    // Struct for holding an inference query and where its result goes
+    // Only one of the two inputs is used
     struct QueueItem {
-        std::vector<Observation> inputs;
-        std::promise<std::vector<InferenceOutput>>* prom;
+        ObservationBatch inputs;
+        CellTypeBatch cell_types;
+        InferenceCallback callback;
+        ErrorCallback on_error;
+
+        bool is_compact() const {
+            return !cell_types.empty();
+        }
+        int size() const {
+            return is_compact() ? cell_types.size() : inputs.size();
+        }
     };
 
+    // Answer a request which won't be run with an error
+    static void fail(QueueItem& item) {
+        item.on_error(std::make_exception_ptr(std::runtime_error("Model evaluator destroyed before answering")));
+    }
+
+    // Queue a request, throwing std::runtime_error if the evaluator is shutting down, as it would never be answered
+    void push(QueueItem item) {
+        if (!queue_.Push(std::move(item))) {
+            throw std::runtime_error("Inference request made while the model evaluator is shutting down");
+        }
+    }
+
+    // Label set of this evaluator's metrics, evaluators without a name are numbered in the order they are created
+    static std::string metric_labels(const std::string& name) {
+        static std::atomic<int> num_unnamed{0};
+        return "evaluator=\"" + (name.empty() ? std::to_string(num_unnamed++) : name) + "\"";
+    }
+
+    // One series of each per evaluator, so that the queues and models of different evaluators aren't mixed
+    const std::string metric_labels_ = metric_labels(options_.name);
+    metrics::Gauge& queue_depth_metric_ = metrics::gauge(
+        "inference_queue_depth", "Requests left waiting when a replica last took a batch", metric_labels_);
+    metrics::Counter& requests_metric_ =
+        metrics::counter("inference_requests_total", "Requests taken for a batch", metric_labels_);
+    metrics::Histogram& batch_size_metric_ = metrics::histogram(
+        "inference_batch_size", "States per forward pass", metrics::exponential_bounds(1, 2, 12), metric_labels_);
+    metrics::Histogram& latency_metric_ =
+        metrics::histogram("inference_latency_us", "Forward pass time per batch in microseconds",
+                           metrics::exponential_bounds(50, 2, 16), metric_labels_);
+    metrics::Histogram& wait_metric_ =
+        metrics::histogram("inference_wait_us", "Time blocking Inference() calls wait on their result in microseconds",
+                           metrics::exponential_bounds(50, 2, 16), metric_labels_);
+
     StopToken stop_token_;
-    ThreadedQueue<QueueItem> queue_;                // Queue for inference requests
+    InferenceQueue<QueueItem> queue_;               // Queue for inference requests
     std::vector<std::thread> inference_threads_;    // Threads for inference requests
 };
 
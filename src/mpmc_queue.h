@@ -0,0 +1,230 @@
+// File: mpmc_queue.h
+// Description: Bounded lock-free multi-producer multi-consumer queue, a drop in for ThreadedQueue
+
+#ifndef MPMC_QUEUE_H_
+#define MPMC_QUEUE_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace internal {
+
+// Spin, then yield, then sleep while waiting on a lock-free structure
+class Backoff {
+public:
+    void pause() {
+        if (count_ < kSpins) {
+#if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+#endif
+        } else if (count_ < kSpins + kYields) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(20));
+        }
+        ++count_;
+    }
+
+private:
+    static constexpr int kSpins = 64;
+    static constexpr int kYields = 64;
+    int count_ = 0;
+};
+
+}    // namespace internal
+
+// Ring buffer of sequenced cells (Vyukov). Producers and consumers each claim a position with a single CAS, so
+// neither side ever takes a lock. Blocking calls wait with a spin/yield/sleep backoff rather than a condition variable.
+template <class T>
+class MPMCQueue {
+public:
+    /**
+     * @param max_size Capacity of the queue, rounded up to a power of two
+     */
+    explicit MPMCQueue(int max_size) : mask_(capacity_for(max_size) - 1), cells_(new Cell[mask_ + 1]) {
+        for (std::size_t i = 0; i <= mask_; ++i) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MPMCQueue(const MPMCQueue&) = delete;
+    MPMCQueue& operator=(const MPMCQueue&) = delete;
+
+    /**
+     * Push a value without blocking.
+     * @param value Value to push, only moved from if the push succeeds
+     * @return True if pushed, false if the queue is full
+     */
+    bool TryPush(T&& value) {
+        Cell* cell;
+        std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells_[pos & mask_];
+            std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+            std::intptr_t diff = (std::intptr_t)seq - (std::intptr_t)pos;
+            if (diff == 0) {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value.emplace(std::move(value));
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Pop a value without blocking.
+     * @return The value, or nullopt if the queue is empty
+     */
+    std::optional<T> TryPop() {
+        Cell* cell;
+        std::size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells_[pos & mask_];
+            std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+            std::intptr_t diff = (std::intptr_t)seq - (std::intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return std::nullopt;
+            } else {
+                pos = dequeue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        std::optional<T> value = std::move(cell->value);
+        cell->value.reset();
+        cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+        return value;
+    }
+
+    // Push a value, blocking while the queue is full. Fails once BlockNewValues has been called.
+    bool Push(T&& value) {
+        internal::Backoff backoff;
+        while (!block_new_values_.load(std::memory_order_relaxed)) {
+            if (TryPush(std::move(value))) {
+                return true;
+            }
+            backoff.pause();
+        }
+        return false;
+    }
+
+    bool Push(const T& value) {
+        return Push(T(value));
+    }
+
+    // Pop a value, blocking while the queue is empty. Returns nullopt once empty and shut down.
+    std::optional<T> Pop() {
+        internal::Backoff backoff;
+        while (true) {
+            std::optional<T> value = TryPop();
+            if (value || block_new_values_.load(std::memory_order_relaxed)) {
+                return value;
+            }
+            backoff.pause();
+        }
+    }
+
+    /**
+     * Pop a group of values, blocking until at least one is available.
+     * After the first value, keeps taking values until the next one would push the accumulated weight past
+     * max_weight, or until max_wait has passed without the queue holding a value that fits.
+     * A value can't be peeked at without claiming it, so the one which doesn't fit is handed back through carry and
+     * should be passed in again on the next call, where it is taken first.
+     * @param max_weight Weight budget for the group (the first value is always taken)
+     * @param weight Callable returning the weight of a value
+     * @param max_wait Max time to wait for further values once the first has been taken
+     * @param carry Value left over from the previous call, set to the value which didn't fit this call
+     * @return Values popped in queue order, empty if the queue is shut down
+     */
+    template <typename WeightFunc>
+    std::vector<T> PopMany(int max_weight, WeightFunc weight, std::chrono::microseconds max_wait,
+                           std::optional<T>& carry) {
+        std::vector<T> values;
+        std::optional<T> first = carry ? std::move(carry) : Pop();
+        carry.reset();
+        if (!first) {
+            return values;
+        }
+        int total_weight = weight(*first);
+        values.push_back(std::move(*first));
+
+        const auto deadline = std::chrono::steady_clock::now() + max_wait;
+        internal::Backoff backoff;
+        while (total_weight < max_weight) {
+            std::optional<T> value = TryPop();
+            if (!value) {
+                if (block_new_values_.load(std::memory_order_relaxed) || std::chrono::steady_clock::now() >= deadline) {
+                    break;
+                }
+                backoff.pause();
+                continue;
+            }
+            int w = weight(*value);
+            if (total_weight + w > max_weight) {
+                carry = std::move(value);
+                break;
+            }
+            total_weight += w;
+            values.push_back(std::move(*value));
+        }
+        return values;
+    }
+
+    bool Empty() const {
+        return Size() == 0;
+    }
+
+    void Clear() {
+        while (TryPop()) {
+        }
+    }
+
+    // Approximate while other threads are pushing or popping
+    int Size() const {
+        std::size_t head = dequeue_pos_.load(std::memory_order_relaxed);
+        std::size_t tail = enqueue_pos_.load(std::memory_order_relaxed);
+        return tail > head ? (int)(tail - head) : 0;
+    }
+
+    // Causes pushing new values to fail. Useful for shutting down the queue.
+    void BlockNewValues() {
+        block_new_values_.store(true, std::memory_order_relaxed);
+    }
+
+private:
+    struct alignas(64) Cell {
+        // Cell is ready to be pushed to at position pos if sequence == pos, or popped from if sequence == pos + 1
+        std::atomic<std::size_t> sequence;
+        std::optional<T> value;
+    };
+
+    static std::size_t capacity_for(int max_size) {
+        std::size_t capacity = 2;
+        while (capacity < (std::size_t)max_size) {
+            capacity <<= 1;
+        }
+        return capacity;
+    }
+
+    const std::size_t mask_;
+    std::unique_ptr<Cell[]> cells_;
+    alignas(64) std::atomic<std::size_t> enqueue_pos_{0};
+    alignas(64) std::atomic<std::size_t> dequeue_pos_{0};
+    alignas(64) std::atomic<bool> block_new_values_{false};
+};
+
+#endif    // MPMC_QUEUE_H_
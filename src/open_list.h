@@ -0,0 +1,176 @@
+// File: open_list.h
+// Description: Priority queues of search nodes for the open list, ordered by (cost, g)
+
+#ifndef OPEN_LIST_H_
+#define OPEN_LIST_H_
+
+#include <algorithm>
+#include <cassert>
+#include <queue>
+#include <vector>
+
+// d-ary min heap of nodes, with the keys stored inline so that sifting never touches the nodes themselves.
+// Nodes need double levin_cost and g members, which are read once on push/update, and an int heap_index member
+// which the heap keeps up to date (-1 when not in the heap) to support updating the key of a queued node.
+// Wider heaps are shallower, trading more comparisons per level for fewer cache lines touched per sift.
+template <typename NodeT, int Arity = 4>
+class DAryHeapOpenList {
+    static_assert(Arity >= 2, "Heap needs at least two children per node");
+
+public:
+    static constexpr bool kCanUpdate = true;
+
+    bool empty() const {
+        return heap_.empty();
+    }
+
+    int size() const {
+        return (int)heap_.size();
+    }
+
+    // Node with the lowest cost, lowest g on ties
+    NodeT *top() const {
+        assert(!heap_.empty());
+        return heap_.front().node;
+    }
+
+    void push(NodeT *node) {
+        assert(node->heap_index < 0);
+        heap_.push_back({node->levin_cost, node->g, node});
+        sift_up((int)heap_.size() - 1);
+    }
+
+    void pop() {
+        assert(!heap_.empty());
+        heap_.front().node->heap_index = -1;
+        heap_.front() = heap_.back();
+        heap_.pop_back();
+        if (!heap_.empty()) {
+            sift_down(0);
+        }
+    }
+
+    /**
+     * Reposition a queued node after its cost or g has changed, in either direction.
+     * @param node Node currently in the heap
+     */
+    void update(NodeT *node) {
+        assert(contains(node));
+        const int i = node->heap_index;
+        heap_[i].cost = node->levin_cost;
+        heap_[i].g = node->g;
+        if (i > 0 && less(heap_[i], heap_[parent(i)])) {
+            sift_up(i);
+        } else {
+            sift_down(i);
+        }
+    }
+
+    bool contains(const NodeT *node) const {
+        return node->heap_index >= 0;
+    }
+
+    void clear() {
+        for (auto &key : heap_) {
+            key.node->heap_index = -1;
+        }
+        heap_.clear();
+    }
+
+private:
+    struct Key {
+        double cost;
+        double g;
+        NodeT *node;
+    };
+
+    static bool less(const Key &left, const Key &right) {
+        return left.cost < right.cost || (left.cost == right.cost && left.g < right.g);
+    }
+
+    static int parent(int i) {
+        return (i - 1) / Arity;
+    }
+
+    // Move the key at i into place, writing it only once
+    void sift_up(int i) {
+        const Key key = heap_[i];
+        while (i > 0 && less(key, heap_[parent(i)])) {
+            place(i, heap_[parent(i)]);
+            i = parent(i);
+        }
+        place(i, key);
+    }
+
+    void sift_down(int i) {
+        const Key key = heap_[i];
+        const int n = (int)heap_.size();
+        while (true) {
+            const int first_child = Arity * i + 1;
+            if (first_child >= n) {
+                break;
+            }
+            int best = first_child;
+            const int last_child = std::min(first_child + Arity, n);
+            for (int c = first_child + 1; c < last_child; ++c) {
+                if (less(heap_[c], heap_[best])) {
+                    best = c;
+                }
+            }
+            if (!less(heap_[best], key)) {
+                break;
+            }
+            place(i, heap_[best]);
+            i = best;
+        }
+        place(i, key);
+    }
+
+    void place(int i, const Key &key) {
+        heap_[i] = key;
+        key.node->heap_index = i;
+    }
+
+    std::vector<Key> heap_;
+};
+
+// Open list backed by std::priority_queue, comparing through the node pointers.
+// Doesn't support updating queued nodes, so callers push a replacement and skip the stale node when popped.
+template <typename NodeT, typename Compare>
+class PriorityQueueOpenList {
+public:
+    static constexpr bool kCanUpdate = false;
+
+    bool empty() const {
+        return queue_.empty();
+    }
+
+    int size() const {
+        return (int)queue_.size();
+    }
+
+    NodeT *top() const {
+        return queue_.top();
+    }
+
+    void push(NodeT *node) {
+        queue_.push(node);
+    }
+
+    void pop() {
+        queue_.pop();
+    }
+
+    void update(NodeT *) {
+        assert(false && "Not supported, check kCanUpdate");
+    }
+
+    void clear() {
+        queue_ = {};
+    }
+
+private:
+    std::priority_queue<NodeT *, std::vector<NodeT *>, Compare> queue_;
+};
+
+#endif    // OPEN_LIST_H_
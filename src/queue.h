@@ -2,10 +2,12 @@
 #define HREAD_SAFE_QUEUE_H_
 
 #include <iostream>
+#include <chrono>
 #include <condition_variable>
 #include <mutex>
 #include <optional>
 #include <queue>
+#include <vector>
 
 // A threadsafe-queue.
 template <class T>
@@ -13,30 +15,91 @@ class ThreadedQueue {
 public:
     explicit ThreadedQueue(int max_size) : max_size_(max_size) {}
 
-    bool Push(const T& value) {
+    // Push a value, blocking while the queue is full. Fails once BlockNewValues has been called.
+    bool Push(T&& value) {
         std::unique_lock<std::mutex> lock(m_);
-        while ((int)q_.size() >= max_size_) {
-            cv_.wait(lock);
+        not_full_.wait(lock, [this]() { return (int)q_.size() < max_size_ || block_new_values_; });
+        if (block_new_values_) {
+            return false;
         }
-        q_.push(value);
-        cv_.notify_one();
+        q_.push(std::move(value));
+        not_empty_.notify_one();
         return true;
     }
 
+    bool Push(const T& value) {
+        return Push(T(value));
+    }
+
     std::optional<T> Pop() {
         std::unique_lock<std::mutex> lock(m_);
-        while (q_.empty()) {
-            if (block_new_values_) {
-                return std::nullopt;
-            }
-            cv_.wait(lock);
+        not_empty_.wait(lock, [this]() { return !q_.empty() || block_new_values_; });
+        if (q_.empty()) {
+            return std::nullopt;
         }
-        T val = q_.front();
+        T val = std::move(q_.front());
         q_.pop();
-        cv_.notify_one();
+        not_full_.notify_one();
         return val;
     }
 
+    /**
+     * Pop a group of values, blocking until at least one is available.
+     * After the first value, keeps taking values until the next one would push the accumulated weight past
+     * max_weight, or until max_wait has passed without the queue holding a value that fits.
+     * @param max_weight Weight budget for the group (the first value is always taken)
+     * @param weight Callable returning the weight of a value
+     * @param max_wait Max time to wait for further values once the first has been taken
+     * @return Values popped in queue order, empty if the queue is shut down
+     */
+    template <typename WeightFunc>
+    std::vector<T> PopMany(int max_weight, WeightFunc weight, std::chrono::microseconds max_wait) {
+        std::vector<T> values;
+        std::unique_lock<std::mutex> lock(m_);
+        not_empty_.wait(lock, [this]() { return !q_.empty() || block_new_values_; });
+        if (q_.empty()) {
+            return values;
+        }
+        const auto deadline = std::chrono::steady_clock::now() + max_wait;
+        int total_weight = 0;
+        bool timed_out = false;
+        while (true) {
+            while (!q_.empty()) {
+                int w = weight(q_.front());
+                if (!values.empty() && total_weight + w > max_weight) {
+                    not_full_.notify_all();
+                    return values;
+                }
+                total_weight += w;
+                values.push_back(std::move(q_.front()));
+                q_.pop();
+            }
+            not_full_.notify_all();
+            if (timed_out || block_new_values_ || total_weight >= max_weight) {
+                break;
+            }
+            // Values arriving right at the deadline are still drained on the next pass
+            timed_out = not_empty_.wait_until(lock, deadline) == std::cv_status::timeout;
+        }
+        return values;
+    }
+
+    /**
+     * PopMany with the same signature as MPMCQueue, so the two can be swapped.
+     * The value which doesn't fit stays at the front of the queue, so carry is only ever consumed, never set.
+     */
+    template <typename WeightFunc>
+    std::vector<T> PopMany(int max_weight, WeightFunc weight, std::chrono::microseconds max_wait,
+                           std::optional<T>& carry) {
+        if (!carry) {
+            return PopMany(max_weight, weight, max_wait);
+        }
+        std::vector<T> values;
+        values.push_back(std::move(*carry));
+        carry.reset();
+        return values;
+    }
+
     bool Empty() {
         std::unique_lock<std::mutex> lock(m_);
         return q_.empty();
@@ -47,6 +110,7 @@ public:
         while (!q_.empty()) {
             q_.pop();
         }
+        not_full_.notify_all();
     }
 
     int Size() {
@@ -58,7 +122,8 @@ public:
     void BlockNewValues() {
         std::unique_lock<std::mutex> lock(m_);
         block_new_values_ = true;
-        cv_.notify_all();
+        not_empty_.notify_all();
+        not_full_.notify_all();
     }
 
 private:
@@ -66,7 +131,8 @@ private:
     int max_size_;
     std::queue<T> q_;
     std::mutex m_;
-    std::condition_variable cv_;
+    std::condition_variable not_empty_;    // Signals consumers that a value was pushed
+    std::condition_variable not_full_;     // Signals producers that space was freed
 };
 
 
@@ -1,6 +1,7 @@
 #ifndef STONESNGEMS_DEFS_H
 #define STONESNGEMS_DEFS_H
 
+#include <algorithm>
 #include <array>
 #include <cassert>
 #include <cstdint>
@@ -10,8 +11,16 @@
 #include <variant>
 #include <vector>
 
+// Max number of cells a board with runtime dimensions can have
+// Boards are stored inline so that states can be copied with a memcpy
+#ifndef STONESNGEMS_MAX_BOARD_CELLS
+#define STONESNGEMS_MAX_BOARD_CELLS 1024
+#endif
+
 namespace stonesngems {
 
+constexpr int kMaxBoardCells = STONESNGEMS_MAX_BOARD_CELLS;
+
 // typedefs
 using Offset = std::array<int, 2>;
 
@@ -792,6 +801,58 @@ inline bool IsMagicWall(const Element &element) {
     return element == kElWallMagicDormant || element == kElWallMagicExpired || element == kElWallMagicOn;
 }
 
+// Check if an item can do anything when scanned in apply_action, all other items only change when acted on
+inline bool CanUpdate(int8_t item) {
+    switch (static_cast<HiddenCellType>(item)) {
+        case HiddenCellType::kStone:
+        case HiddenCellType::kStoneFalling:
+        case HiddenCellType::kDiamond:
+        case HiddenCellType::kDiamondFalling:
+        case HiddenCellType::kExitClosed:
+        case HiddenCellType::kFireflyUp:
+        case HiddenCellType::kFireflyLeft:
+        case HiddenCellType::kFireflyDown:
+        case HiddenCellType::kFireflyRight:
+        case HiddenCellType::kButterflyUp:
+        case HiddenCellType::kButterflyLeft:
+        case HiddenCellType::kButterflyDown:
+        case HiddenCellType::kButterflyRight:
+        case HiddenCellType::kWallMagicDormant:
+        case HiddenCellType::kWallMagicOn:
+        case HiddenCellType::kWallMagicExpired:
+        case HiddenCellType::kBlob:
+        case HiddenCellType::kExplosionDiamond:
+        case HiddenCellType::kExplosionBoulder:
+        case HiddenCellType::kExplosionEmpty:
+        case HiddenCellType::kNut:
+        case HiddenCellType::kNutFalling:
+        case HiddenCellType::kBomb:
+        case HiddenCellType::kBombFalling:
+        case HiddenCellType::kOrangeUp:
+        case HiddenCellType::kOrangeLeft:
+        case HiddenCellType::kOrangeDown:
+        case HiddenCellType::kOrangeRight:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Check if an item which CanUpdate only depends on its neighbours (and for exits, the gems collected), so once
+// scanned without changing it can be skipped until one of those changes
+inline bool CanSettle(int8_t item) {
+    switch (static_cast<HiddenCellType>(item)) {
+        case HiddenCellType::kStone:
+        case HiddenCellType::kDiamond:
+        case HiddenCellType::kNut:
+        case HiddenCellType::kBomb:
+        case HiddenCellType::kExitClosed:
+            return true;
+        default:
+            return false;
+    }
+}
+
 inline bool IsOpenGate(const Element &element) {
     return element == kElGateRedOpen || element == kElGateBlueOpen || element == kElGateGreenOpen ||
            element == kElGateYellowOpen;
@@ -805,9 +866,63 @@ inline std::underlying_type_t<HiddenCellType> ElementToItem(const Element &eleme
     return static_cast<std::underlying_type_t<HiddenCellType>>(element.cell_type);
 }
 
-struct Board {
-    Board() = delete;
-    Board(int rows, int cols, uint8_t gems_required, int max_steps)
+// Fixed capacity bitset stored inline
+template <int N>
+class FlatBitset {
+public:
+    bool test(int index) const {
+        return (words_[index >> 6] >> (index & 63)) & 1;
+    }
+
+    void set(int index) {
+        words_[index >> 6] |= uint64_t{1} << (index & 63);
+    }
+
+    void set(int index, bool value) {
+        words_[index >> 6] = (words_[index >> 6] & ~(uint64_t{1} << (index & 63))) | (uint64_t{value} << (index & 63));
+    }
+
+    // Clear the first num_bits bits
+    void reset(int num_bits) {
+        std::fill(words_.begin(), words_.begin() + (num_bits + 63) / 64, 0);
+    }
+
+    // Check if the first num_bits bits match those of other
+    bool equal_prefix(const FlatBitset &other, int num_bits) const {
+        const int full_words = num_bits / 64;
+        if (!std::equal(words_.begin(), words_.begin() + full_words, other.words_.begin())) {
+            return false;
+        }
+        const uint64_t tail_mask = (uint64_t{1} << (num_bits & 63)) - 1;
+        return (num_bits & 63) == 0 || ((words_[full_words] ^ other.words_[full_words]) & tail_mask) == 0;
+    }
+
+    // Call func with the index of each set bit, in increasing order, among the first num_bits bits.
+    // The bits are reread after each call, so bits func sets past the current index are visited too (and those it
+    // clears are skipped).
+    template <typename Func>
+    void for_each_set(int num_bits, Func func) {
+        for (int w = 0; w < (num_bits + 63) / 64; ++w) {
+            uint64_t visited = 0;
+            for (uint64_t word = words_[w]; word != 0; word = words_[w] & ~visited) {
+                const int bit = __builtin_ctzll(word);
+                visited = (uint64_t{2} << bit) - 1;    // Wraps to all bits for bit 63
+                func(w * 64 + bit);
+            }
+        }
+    }
+
+private:
+    std::array<uint64_t, (N + 63) / 64> words_{};
+};
+
+// Board with inline storage for up to Capacity cells
+template <int Capacity>
+struct BoardT {
+    static constexpr int kCapacity = Capacity;
+
+    BoardT() = delete;
+    BoardT(int rows, int cols, uint8_t gems_required, int max_steps)
         : zorb_hash(0),
           rows(rows),
           cols(cols),
@@ -815,11 +930,13 @@ struct Board {
           agent_pos(-1),
           agent_idx(-1),
           max_steps(max_steps),
-          grid(rows * cols, 0),
-          has_updated(rows * cols, 0) {}
+          grid{} {
+        assert(rows * cols <= Capacity);
+    }
 
-    bool operator==(const Board &other) const {
-        return grid == other.grid;
+    bool operator==(const BoardT &other) const {
+        return rows == other.rows && cols == other.cols &&
+               std::equal(grid.begin(), grid.begin() + rows * cols, other.grid.begin());
     }
 
     int8_t &item(int index) {
@@ -852,9 +969,7 @@ struct Board {
     }
 
     void reset_updated() {
-        for (int i = 0; i < rows * cols; ++i) {
-            has_updated[i] = false;
-        }
+        has_updated.reset(rows * cols);
     }
 
     uint64_t zorb_hash;
@@ -864,10 +979,13 @@ struct Board {
     int agent_pos;
     int agent_idx;
     int max_steps;
-    std::vector<int8_t> grid;
-    std::vector<bool> has_updated;
+    std::array<int8_t, Capacity> grid;    // Only the first rows * cols cells are used
+    FlatBitset<Capacity> has_updated;
+    FlatBitset<Capacity> active;          // Cells which may change when scanned, kept in sync by the state
 };
 
+using Board = BoardT<kMaxBoardCells>;
+
 }    // namespace stonesngems
 
 #endif    // STONESNGEMS_DEFS_H
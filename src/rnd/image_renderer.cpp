@@ -0,0 +1,80 @@
+#include "image_renderer.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "definitions.h"
+
+namespace stonesngems {
+
+namespace {
+
+// Sprites of every visible cell type back to back, indexed by the type, so a cell's sprite is found without a lookup
+const uint8_t *sprite_atlas() {
+    static const std::vector<uint8_t> atlas = []() {
+        std::vector<uint8_t> atlas((std::size_t)kNumVisibleCellType * kSpriteBytes, 0);
+        for (const auto &[cell_type, data] : img_asset_map) {
+            const int index = static_cast<int>(cell_type);
+            assert(index >= 0 && index < kNumVisibleCellType);
+            assert(data.size() == (std::size_t)kSpriteBytes);
+            std::memcpy(atlas.data() + (std::size_t)index * kSpriteBytes, data.data(), kSpriteBytes);
+        }
+        return atlas;
+    }();
+    return atlas.data();
+}
+
+// Copy the sprite of a cell into the image, a sprite row (contiguous in both) at a time.
+// Cell types can come from outside (board_to_image), so are checked rather than reading past the atlas.
+inline void blit_cell(const uint8_t *atlas, int8_t cell_type, int row, int col, int cols, uint8_t *dst) {
+    if (cell_type < 0 || cell_type >= kNumVisibleCellType) {
+        throw std::out_of_range("No sprite for visible cell type " + std::to_string(cell_type));
+    }
+    const std::size_t image_row_bytes = (std::size_t)cols * kSpriteRowBytes;
+    const uint8_t *sprite = atlas + (std::size_t)cell_type * kSpriteBytes;
+    uint8_t *top_left = dst + (std::size_t)row * kSpriteSize * image_row_bytes + (std::size_t)col * kSpriteRowBytes;
+    for (int r = 0; r < kSpriteSize; ++r) {
+        std::memcpy(top_left + r * image_row_bytes, sprite + r * kSpriteRowBytes, kSpriteRowBytes);
+    }
+}
+
+}    // namespace
+
+void render_image(const int8_t *cell_types, int rows, int cols, uint8_t *dst) {
+    const uint8_t *atlas = sprite_atlas();
+    for (int h = 0; h < rows; ++h) {
+        for (int w = 0; w < cols; ++w) {
+            blit_cell(atlas, cell_types[h * cols + w], h, w, cols, dst);
+        }
+    }
+}
+
+IncrementalRenderer::IncrementalRenderer(int rows, int cols)
+    : rows_(rows), cols_(cols), previous_(rows * cols, static_cast<int8_t>(VisibleCellType::kNull)) {
+    assert(rows > 0 && cols > 0);
+}
+
+int IncrementalRenderer::render(const int8_t *cell_types, uint8_t *dst) {
+    const uint8_t *atlas = sprite_atlas();
+    int redrawn = 0;
+    for (int h = 0; h < rows_; ++h) {
+        for (int w = 0; w < cols_; ++w) {
+            const int i = h * cols_ + w;
+            if (cell_types[i] != previous_[i]) {
+                blit_cell(atlas, cell_types[i], h, w, cols_, dst);
+                previous_[i] = cell_types[i];
+                ++redrawn;
+            }
+        }
+    }
+    return redrawn;
+}
+
+void IncrementalRenderer::reset() {
+    std::fill(previous_.begin(), previous_.end(), static_cast<int8_t>(VisibleCellType::kNull));
+}
+
+}    // namespace stonesngems
@@ -0,0 +1,65 @@
+#ifndef STONESNGEMS_IMAGE_RENDERER_H
+#define STONESNGEMS_IMAGE_RENDERER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace stonesngems {
+
+constexpr int kSpriteSize = 32;        // Sprites are square, this many pixels a side
+constexpr int kSpriteChannels = 3;    // RGB
+constexpr int kSpriteRowBytes = kSpriteSize * kSpriteChannels;
+constexpr int kSpriteBytes = kSpriteSize * kSpriteRowBytes;
+
+/**
+ * Bytes in the HWC RGB image of a board.
+ * @param rows Rows of the board
+ * @param cols Columns of the board
+ * @return Size of the image in bytes
+ */
+inline std::size_t image_size(int rows, int cols) {
+    return (std::size_t)rows * cols * kSpriteBytes;
+}
+
+/**
+ * Render a board into a flat HWC RGB image, one sprite per cell, throwing std::out_of_range for unknown cell types.
+ * Sprites are taken from an atlas holding every visible cell type back to back, built on first use, and are copied
+ * a sprite row at a time.
+ * @param cell_types Visible cell type of each cell, row major (as written by write_cell_types())
+ * @param rows Rows of the board
+ * @param cols Columns of the board
+ * @param dst Image buffer of at least image_size(rows, cols) bytes
+ */
+void render_image(const int8_t *cell_types, int rows, int cols, uint8_t *dst);
+
+// Renders successive frames of the same board into a caller owned image, only redrawing the cells which changed
+// since the previous frame. The image must be left untouched between frames.
+class IncrementalRenderer {
+public:
+    /**
+     * @param rows Rows of the board
+     * @param cols Columns of the board
+     */
+    IncrementalRenderer(int rows, int cols);
+
+    /**
+     * Render the next frame, which is a full render if there was no previous frame.
+     * @param cell_types Visible cell type of each cell, row major
+     * @param dst Image holding the previous frame, of at least image_size(rows, cols) bytes
+     * @return Number of cells redrawn
+     */
+    int render(const int8_t *cell_types, uint8_t *dst);
+
+    // Forget the previous frame, so the next render redraws every cell (e.g. when changing buffers)
+    void reset();
+
+private:
+    int rows_;
+    int cols_;
+    std::vector<int8_t> previous_;    // Cell types of the previous frame, kNull if not yet drawn
+};
+
+}    // namespace stonesngems
+
+#endif    // STONESNGEMS_IMAGE_RENDERER_H
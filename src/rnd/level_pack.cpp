@@ -0,0 +1,159 @@
+#include "level_pack.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+namespace stonesngems {
+namespace util {
+
+namespace {
+
+constexpr char kPackMagic[4] = {'R', 'N', 'D', 'P'};
+constexpr uint32_t kPackVersion = 1;
+constexpr std::size_t kPackHeaderSize = 16;
+
+template <typename T>
+void append_field(std::vector<char> &out, T value) {
+    const char *bytes = reinterpret_cast<const char *>(&value);
+    out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+// Fields aren't aligned in the file, so are copied out rather than cast
+template <typename T>
+T read_field(const char *data) {
+    T value;
+    std::memcpy(&value, data, sizeof(T));
+    return value;
+}
+
+// View of an encoded level, without any checks
+LevelView read_level(const char *data) {
+    LevelView level;
+    level.rows = read_field<int16_t>(data);
+    level.cols = read_field<int16_t>(data + 2);
+    level.max_steps = read_field<int32_t>(data + 4);
+    level.max_gems = read_field<int32_t>(data + 8);
+    level.grid = reinterpret_cast<const int8_t *>(data + kLevelHeaderSize);
+    return level;
+}
+
+}    // namespace
+
+void encode_level(const LevelView &level, std::vector<char> &out) {
+    // Dimensions are stored as int16, so larger ones would be silently truncated
+    constexpr int kMaxDimension = std::numeric_limits<int16_t>::max();
+    if (level.rows <= 0 || level.cols <= 0 || level.rows > kMaxDimension || level.cols > kMaxDimension) {
+        throw std::invalid_argument("Level dimensions must be between 1 and " + std::to_string(kMaxDimension));
+    }
+    out.reserve(out.size() + kLevelHeaderSize + level.rows * level.cols);
+    append_field<int16_t>(out, level.rows);
+    append_field<int16_t>(out, level.cols);
+    append_field<int32_t>(out, level.max_steps);
+    append_field<int32_t>(out, level.max_gems);
+    const char *grid = reinterpret_cast<const char *>(level.grid);
+    out.insert(out.end(), grid, grid + level.rows * level.cols);
+}
+
+LevelView decode_level(const char *data, std::size_t size) {
+    if (size < kLevelHeaderSize) {
+        throw std::invalid_argument("Level is truncated");
+    }
+    const LevelView level = read_level(data);
+    if (level.rows <= 0 || level.cols <= 0 || size - kLevelHeaderSize < (std::size_t)(level.rows * level.cols)) {
+        throw std::invalid_argument("Level is truncated");
+    }
+    // Cells index the hashing and element tables when the level is played, so must be known item types
+    for (int i = 0; i < level.rows * level.cols; ++i) {
+        if (level.grid[i] < 0 || level.grid[i] >= kNumHiddenCellType) {
+            throw std::invalid_argument("Level has an unknown cell type");
+        }
+    }
+    return level;
+}
+
+void write_level_pack(const std::string &path, const std::vector<LevelView> &levels) {
+    std::vector<char> out(kPackMagic, kPackMagic + sizeof(kPackMagic));
+    append_field<uint32_t>(out, kPackVersion);
+    append_field<uint64_t>(out, levels.size());
+
+    // Offsets are filled in as each level is appended
+    const std::size_t offsets_start = out.size();
+    out.resize(offsets_start + levels.size() * sizeof(uint64_t));
+    for (std::size_t i = 0; i < levels.size(); ++i) {
+        const uint64_t offset = out.size();
+        std::memcpy(out.data() + offsets_start + i * sizeof(uint64_t), &offset, sizeof(offset));
+        encode_level(levels[i], out);
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    file.write(out.data(), out.size());
+    if (!file) {
+        throw std::runtime_error("Could not write level pack " + path);
+    }
+}
+
+LevelPack::LevelPack(const std::string &path) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open level pack " + path);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size < (off_t)kPackHeaderSize) {
+        ::close(fd);
+        throw std::runtime_error("Level pack " + path + " is truncated");
+    }
+    size_ = st.st_size;
+    void *mapping = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        throw std::runtime_error("Could not map level pack " + path);
+    }
+    data_ = static_cast<const char *>(mapping);
+
+    // Check every level once here (header, size and cell types), so level() can view them without checks
+    try {
+        if (std::memcmp(data_, kPackMagic, sizeof(kPackMagic)) != 0 ||
+            read_field<uint32_t>(data_ + sizeof(kPackMagic)) != kPackVersion) {
+            throw std::runtime_error("Level pack " + path + " has an unknown format");
+        }
+        num_levels_ = read_field<uint64_t>(data_ + 8);
+        if (num_levels_ > (size_ - kPackHeaderSize) / sizeof(uint64_t)) {
+            throw std::runtime_error("Level pack " + path + " is truncated");
+        }
+        for (int i = 0; i < size(); ++i) {
+            const std::size_t offset = level_offset(i);
+            if (offset > size_) {
+                throw std::runtime_error("Level pack " + path + " is truncated");
+            }
+            decode_level(data_ + offset, size_ - offset);
+        }
+    } catch (const std::exception &e) {
+        ::munmap(const_cast<char *>(data_), size_);
+        throw std::runtime_error(e.what());
+    }
+}
+
+LevelPack::~LevelPack() {
+    ::munmap(const_cast<char *>(data_), size_);
+}
+
+LevelView LevelPack::level(int index) const {
+    assert(index >= 0 && index < size());
+    return read_level(data_ + level_offset(index));
+}
+
+std::size_t LevelPack::level_offset(int index) const {
+    return read_field<uint64_t>(data_ + kPackHeaderSize + index * sizeof(uint64_t));
+}
+
+}    // namespace util
+}    // namespace stonesngems
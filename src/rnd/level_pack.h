@@ -0,0 +1,77 @@
+#ifndef STONESNGEMS_LEVEL_PACK_H
+#define STONESNGEMS_LEVEL_PACK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "util.h"
+
+// Binary level format, all fields in host byte order (little endian on every supported target):
+//   level: int16 rows | int16 cols | int32 max_steps | int32 max_gems | int8 grid[rows * cols]
+//   pack:  char magic[4] = "RNDP" | uint32 version | uint64 num_levels | uint64 offsets[num_levels] | levels
+// Offsets are from the start of the pack, so a level is found without reading the ones before it.
+namespace stonesngems {
+namespace util {
+
+constexpr std::size_t kLevelHeaderSize = 12;
+
+/**
+ * Append the binary encoding of a level, throwing std::invalid_argument if its dimensions don't fit the encoding.
+ * @param level Level to encode
+ * @param out Buffer to append to
+ */
+void encode_level(const LevelView &level, std::vector<char> &out);
+
+/**
+ * View a binary encoded level in place, throwing std::invalid_argument if it is truncated or has unknown cell types.
+ * @param data Start of the encoding, which must outlive the view
+ * @param size Bytes available from data
+ * @return View of the level, its grid pointing into data
+ */
+LevelView decode_level(const char *data, std::size_t size);
+
+/**
+ * Write a level pack.
+ * @param path File to write to
+ * @param levels Levels in the order they are indexed by
+ */
+void write_level_pack(const std::string &path, const std::vector<LevelView> &levels);
+
+// Read only memory mapping of a level pack, which is validated once on opening.
+// Levels are viewed in place, so states started from them need the pack to stay open for their lifetime.
+class LevelPack {
+public:
+    /**
+     * @param path Level pack to map, throws std::runtime_error if it can't be read or isn't valid
+     */
+    explicit LevelPack(const std::string &path);
+    ~LevelPack();
+
+    LevelPack(const LevelPack &) = delete;
+    LevelPack &operator=(const LevelPack &) = delete;
+
+    int size() const {
+        return (int)num_levels_;
+    }
+
+    /**
+     * View a level of the pack.
+     * @param index Index of the level, less than size()
+     * @return View of the level, valid while the pack is open
+     */
+    LevelView level(int index) const;
+
+private:
+    std::size_t level_offset(int index) const;
+
+    const char *data_ = nullptr;
+    std::size_t size_ = 0;
+    uint64_t num_levels_ = 0;
+};
+
+}    // namespace util
+}    // namespace stonesngems
+
+#endif    // STONESNGEMS_LEVEL_PACK_H
@@ -1,22 +1,167 @@
 #include "stonesngems_base.h"
 
+#include <algorithm>
 #include <cstdint>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
 
 #include "definitions.h"
+#include "image_renderer.h"
 
 namespace stonesngems {
 
-RNDGameState::RNDGameState(const GameParameters &params)
-    : shared_state_ptr(std::make_shared<SharedStateInfo>(params)),
-      board(util::parse_board_str(std::get<std::string>(params.at("game_board_str")))) {
+namespace {
+
+// Set up the tables which only depend on the game parameters and board dimensions
+void init_shared_state(SharedStateInfo &info, int rows, int cols) {
+    info.blob_chance = (cols * rows) * info.blob_max_size;
+
+    // zorbist hashing, channel major so that the values match the order they are drawn in
+    std::mt19937 gen(info.rng_seed);
+    std::uniform_int_distribution<uint64_t> dist(0);
+    info.zrbht.resize(kNumHiddenCellType * cols * rows);
+    for (int channel = 0; channel < kNumHiddenCellType; ++channel) {
+        for (int i = 0; i < cols * rows; ++i) {
+            info.zrbht[(channel * cols * rows) + i] = dist(gen);
+        }
+    }
+
+    // In bounds fast access
+    info.in_bounds_board.clear();
+    info.in_bounds_board.insert(info.in_bounds_board.end(), (cols + 2) * (rows + 2), true);
+    // Pad the outer boarder
+    for (int i = 0; i < cols + 2; ++i) {
+        info.in_bounds_board[i] = false;
+        info.in_bounds_board[(rows + 1) * (cols + 2) + i] = false;
+    }
+    for (int i = 0; i < rows + 2; ++i) {
+        info.in_bounds_board[i * (cols + 2)] = false;
+        info.in_bounds_board[i * (cols + 2) + cols + 1] = false;
+    }
+    // In bounds idx conversion table
+    info.board_to_inbounds.clear();
+    for (int r = 0; r < rows; ++r) {
+        for (int c = 0; c < cols; ++c) {
+            info.board_to_inbounds.push_back((cols + 2) * (r + 1) + c + 1);
+        }
+    }
+}
+
+// Canonical string of the parameters, other than the board string
+std::string shared_state_key(const GameParameters &params) {
+    std::vector<std::string> names;
+    names.reserve(params.size());
+    for (const auto &param : params) {
+        if (param.first != "game_board_str") {
+            names.push_back(param.first);
+        }
+    }
+    std::sort(names.begin(), names.end());
+    std::ostringstream key;
+    key << std::hexfloat;
+    for (const auto &name : names) {
+        const GameParameter &value = params.at(name);
+        key << name << '=' << value.index() << ':';
+        std::visit([&key](const auto &v) { key << v; }, value);
+        key << ';';
+    }
+    return key.str();
+}
+
+// Shared info is interned by the parameters other than the board, plus the board dimensions, so all levels of the
+// same dimensions share the same tables whether started from a board string or a level view.
+// States only hold a raw pointer to their shared info, so it is kept for the lifetime of the process, but there is
+// only one per distinct parameters and dimensions. Boards are kept in the board store instead.
+const SharedStateInfo *make_shared_state(const GameParameters &params, int rows, int cols) {
+    static std::mutex m;
+    static std::deque<SharedStateInfo> store;
+    static std::unordered_map<std::string, const SharedStateInfo *> registry;
+    std::string key = shared_state_key(params) + "dims=" + std::to_string(rows) + "x" + std::to_string(cols) + ';';
+    std::unique_lock<std::mutex> lock(m);
+    auto iter = registry.find(key);
+    if (iter != registry.end()) {
+        return iter->second;
+    }
+    GameParameters shared_params = params;
+    shared_params.erase("game_board_str");
+    SharedStateInfo &info = store.emplace_back(shared_params);
+    init_shared_state(info, rows, cols);
+    registry.emplace(std::move(key), &info);
+    return &info;
+}
+
+// Parsed boards, interned by board string so that states only view them, until released
+struct BoardStore {
+    std::mutex m;
+    std::unordered_map<std::string, std::unique_ptr<const util::BoardSpec>> boards;
+};
+
+BoardStore &board_store() {
+    static BoardStore store;
+    return store;
+}
+
+const util::BoardSpec &intern_board(const std::string &board_str) {
+    BoardStore &store = board_store();
+    std::unique_lock<std::mutex> lock(store.m);
+    auto iter = store.boards.find(board_str);
+    if (iter == store.boards.end()) {
+        auto board = std::make_unique<const util::BoardSpec>(util::parse_board_spec(board_str));
+        iter = store.boards.emplace(board_str, std::move(board)).first;
+    }
+    return *iter->second;
+}
+
+}    // namespace
+
+bool release_board(const std::string &board_str) {
+    BoardStore &store = board_store();
+    std::unique_lock<std::mutex> lock(store.m);
+    return store.boards.erase(board_str) > 0;
+}
+
+template <typename Dims>
+RNDGameStateImpl<Dims>::RNDGameStateImpl(const GameParameters &params)
+    : RNDGameStateImpl(params, util::view_level(intern_board(std::get<std::string>(params.at("game_board_str"))))) {}
+
+template <typename Dims>
+RNDGameStateImpl<Dims>::RNDGameStateImpl(const GameParameters &params, const util::LevelView &level)
+    : shared_state_ptr(make_shared_state(params, level.rows, level.cols)),
+      start_level(level),
+      board(util::board_from_level<Dims::kCells>(level)) {
+    CheckDims();
     reset();
 }
 
-bool RNDGameState::operator==(const RNDGameState &other) const {
+template <typename Dims>
+RNDGameStateImpl<Dims>::RNDGameStateImpl(const RNDGameStateImpl &other, const util::LevelView &level)
+    : shared_state_ptr(level.rows == other.board.rows && level.cols == other.board.cols
+                           ? other.shared_state_ptr
+                           : make_shared_state(other.shared_state_ptr->params, level.rows, level.cols)),
+      start_level(level),
+      board(util::board_from_level<Dims::kCells>(level)) {
+    CheckDims();
+    reset();
+}
+
+template <typename Dims>
+void RNDGameStateImpl<Dims>::CheckDims() const {
+    if constexpr (Dims::kFixed) {
+        if (board.rows != Dims::kRows || board.cols != Dims::kCols) {
+            throw std::invalid_argument("Board dimensions do not match the fixed state dimensions");
+        }
+    }
+}
+
+template <typename Dims>
+bool RNDGameStateImpl<Dims>::operator==(const RNDGameStateImpl &other) const {
     return local_state == other.local_state && board == other.board;
 }
 
-bool RNDGameState::operator!=(const RNDGameState &other) const {
+template <typename Dims>
+bool RNDGameStateImpl<Dims>::operator!=(const RNDGameStateImpl &other) const {
     return !(*this == other);
 }
 
@@ -41,217 +186,250 @@ uint64_t xorshift64(uint64_t &s) {
     return x;
 }
 
-void RNDGameState::reset() {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::reset() {
     // Board, local, and shared state info
-    board = util::parse_board_str(shared_state_ptr->game_board_str);
-    local_state = LocalState();
+    board = util::board_from_level<Dims::kCells>(start_level);
+    local_state = LocalStateType();
     local_state.random_state = splitmix64(shared_state_ptr->rng_seed);
     local_state.steps_remaining = board.max_steps;
-    shared_state_ptr->blob_chance = (board.cols * board.rows) * shared_state_ptr->blob_max_size;
 
     // Set the item IDs
-    for (int i = 0; i < board.cols * board.rows; ++i) {
+    for (int i = 0; i < Cols() * Rows(); ++i) {
         AddIndexID(i);
     }
 
-    // zorbist hashing
-    std::mt19937 gen(shared_state_ptr->rng_seed);
-    std::uniform_int_distribution<uint64_t> dist(0);
-    for (int channel = 0; channel < kNumHiddenCellType; ++channel) {
-        for (int i = 0; i < board.cols * board.rows; ++i) {
-            shared_state_ptr->zrbht[(channel * board.cols * board.rows) + i] = dist(gen);
-        }
+    // Set the cells which need visiting each step
+    for (int i = 0; i < Cols() * Rows(); ++i) {
+        board.active.set(i, CanUpdate(board.item(i)));
     }
 
     // Set initial hash
-    for (int i = 0; i < board.cols * board.rows; ++i) {
-        board.zorb_hash ^= shared_state_ptr->zrbht.at((board.item(i) * board.cols * board.rows) + i);
-    }
-
-    // In bounds fast access
-    shared_state_ptr->in_bounds_board.clear();
-    shared_state_ptr->in_bounds_board.insert(shared_state_ptr->in_bounds_board.end(),
-                                             (board.cols + 2) * (board.rows + 2), true);
-    // Pad the outer boarder
-    for (int i = 0; i < board.cols + 2; ++i) {
-        shared_state_ptr->in_bounds_board[i] = false;
-        shared_state_ptr->in_bounds_board[(board.rows + 1) * (board.cols + 2) + i] = false;
-    }
-    for (int i = 0; i < board.rows + 2; ++i) {
-        shared_state_ptr->in_bounds_board[i * (board.cols + 2)] = false;
-        shared_state_ptr->in_bounds_board[i * (board.cols + 2) + board.cols + 1] = false;
-    }
-    // In bounds idx conversion table
-    shared_state_ptr->board_to_inbounds.clear();
-    for (int r = 0; r < board.rows; ++r) {
-        for (int c = 0; c < board.cols; ++c) {
-            shared_state_ptr->board_to_inbounds.push_back((board.cols + 2) * (r + 1) + c + 1);
-        }
+    for (int i = 0; i < Cols() * Rows(); ++i) {
+        board.zorb_hash ^= shared_state_ptr->zrbht[(board.item(i) * Cols() * Rows()) + i];
     }
 }
 
-void RNDGameState::apply_action(int action) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::apply_action(int action) {
     assert(action >= 0 && action < kNumActions);
     StartScan();
 
     // Handle agent first
     UpdateAgent(board.agent_idx, static_cast<Directions>(action));
+    UpdateItems();
+    EndScan();
+}
 
-    // Handle all other items
-    for (int i = 0; i < board.rows * board.cols; ++i) {
-        if (board.has_updated[i]) {    // Item already updated
+template <typename Dims>
+void RNDGameStateImpl<Dims>::expand_all(std::array<RNDGameStateImpl, kNumActions> &children) const {
+    static_assert(Directions::kNoop == 0, "kNoop is stepped first, so that the others can fall back to it");
+    RNDGameStateImpl start = *this;
+    start.StartScan();
+
+    // If the agent changed nothing the rest of the step only depends on the starting state, so is shared by all
+    // such actions. The noop result is reused, as long as the noop itself changed nothing.
+    bool noop_unchanged = false;
+    for (int action = 0; action < kNumActions; ++action) {
+        RNDGameStateImpl &child = children[action];
+        child = start;
+        child.UpdateAgent(child.board.agent_idx, static_cast<Directions>(action));
+        const bool unchanged = child.board.agent_pos == start.board.agent_pos &&
+                               child.board.agent_idx == start.board.agent_idx && child.local_state == start.local_state &&
+                               child.board == start.board &&
+                               child.board.has_updated.equal_prefix(start.board.has_updated, Rows() * Cols());
+        if (action == Directions::kNoop) {
+            noop_unchanged = unchanged;
+        } else if (unchanged && noop_unchanged) {
+            child = children[Directions::kNoop];
             continue;
         }
-        switch (board.item(i)) {
-            // Handle non-compound types
-            case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kStone):
-                UpdateStone(i);
-                break;
-            case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kStoneFalling):
-                UpdateStoneFalling(i);
-                break;
-            case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kDiamond):
-                UpdateDiamond(i);
-                break;
-            case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kDiamondFalling):
-                UpdateDiamondFalling(i);
-                break;
-            case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kNut):
-                UpdateNut(i);
-                break;
-            case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kNutFalling):
-                UpdateNutFalling(i);
-                break;
-            case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kBomb):
-                UpdateBomb(i);
-                break;
-            case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kBombFalling):
-                UpdateBombFalling(i);
-                break;
-            case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kExitClosed):
-                UpdateExit(i);
-                break;
-            case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kBlob):
-                UpdateBlob(i);
-                break;
-            default:
-                // Handle compound types
-                const Element &element = kCellTypeToElement[board.item(i) + 1];
-                if (IsButterfly(element)) {
-                    UpdateButterfly(i, kButterflyToDirection.at(element));
-                } else if (IsFirefly(element)) {
-                    UpdateFirefly(i, kFireflyToDirection.at(element));
-                } else if (IsOrange(element)) {
-                    UpdateOrange(i, kOrangeToDirection.at(element));
-                } else if (IsMagicWall(element)) {
-                    UpdateMagicWall(i);
-                } else if (IsExplosion(element)) {
-                    UpdateExplosions(i);
-                }
-                break;
-        }
+        child.UpdateItems();
+        child.EndScan();
     }
+}
 
-    EndScan();
+template <typename Dims>
+void RNDGameStateImpl<Dims>::UpdateItems() {
+#ifdef STONESNGEMS_FULL_SCAN
+    for (int i = 0; i < Rows() * Cols(); ++i) {
+        UpdateCell(i);
+    }
+#else
+    // Only active cells need visiting: those holding an item which CanUpdate, less settled items whose neighbours
+    // haven't changed since they last did nothing. Cells are woken as the scan goes, so those ahead of it are still
+    // visited this step, and the result is identical to the full scan.
+    board.active.for_each_set(Rows() * Cols(), [this](int i) {
+        UpdateCell(i);
+        if (CanSettle(board.item(i)) && !board.has_updated.test(i)) {
+            board.active.set(i, false);
+        }
+    });
+#endif
 }
 
-bool RNDGameState::is_terminal() const {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::UpdateCell(int i) {
+    if (board.has_updated.test(i)) {    // Item already updated
+        return;
+    }
+    switch (board.item(i)) {
+        // Handle non-compound types
+        case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kStone):
+            UpdateStone(i);
+            break;
+        case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kStoneFalling):
+            UpdateStoneFalling(i);
+            break;
+        case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kDiamond):
+            UpdateDiamond(i);
+            break;
+        case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kDiamondFalling):
+            UpdateDiamondFalling(i);
+            break;
+        case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kNut):
+            UpdateNut(i);
+            break;
+        case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kNutFalling):
+            UpdateNutFalling(i);
+            break;
+        case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kBomb):
+            UpdateBomb(i);
+            break;
+        case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kBombFalling):
+            UpdateBombFalling(i);
+            break;
+        case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kExitClosed):
+            UpdateExit(i);
+            break;
+        case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kBlob):
+            UpdateBlob(i);
+            break;
+        default:
+            // Handle compound types
+            const Element &element = kCellTypeToElement[board.item(i) + 1];
+            if (IsButterfly(element)) {
+                UpdateButterfly(i, kButterflyToDirection.at(element));
+            } else if (IsFirefly(element)) {
+                UpdateFirefly(i, kFireflyToDirection.at(element));
+            } else if (IsOrange(element)) {
+                UpdateOrange(i, kOrangeToDirection.at(element));
+            } else if (IsMagicWall(element)) {
+                UpdateMagicWall(i);
+            } else if (IsExplosion(element)) {
+                UpdateExplosions(i);
+            }
+            break;
+    }
+}
+
+template <typename Dims>
+bool RNDGameStateImpl<Dims>::is_terminal() const {
     // timeout or agent is either dead/in exit
     bool out_of_time = (board.max_steps > 0 && local_state.steps_remaining <= 0);
     return out_of_time || board.agent_pos < 0;
 }
 
-bool RNDGameState::is_solution() const {
+template <typename Dims>
+bool RNDGameStateImpl<Dims>::is_solution() const {
     // not timeout and agent is in exit
     bool out_of_time = (board.max_steps > 0 && local_state.steps_remaining <= 0);
     return !out_of_time && board.agent_pos == kAgentPosExit;
 }
 
-std::vector<int> RNDGameState::legal_actions() const {
-    return {Directions::kNoop, Directions::kUp, Directions::kRight, Directions::kDown, Directions::kLeft};
+template <typename Dims>
+std::vector<int> RNDGameStateImpl<Dims>::legal_actions() const {
+    return {kLegalActions.begin(), kLegalActions.end()};
+}
+
+template <typename Dims>
+std::array<int, 3> RNDGameStateImpl<Dims>::observation_shape() const {
+    return {kNumVisibleCellType, Cols(), Rows()};
 }
 
-std::array<int, 3> RNDGameState::observation_shape() const {
-    return {kNumVisibleCellType, board.cols, board.rows};
+template <typename Dims>
+std::vector<float> RNDGameStateImpl<Dims>::get_observation() const {
+    std::vector<float> obs(observation_size());
+    write_observation(obs.data());
+    return obs;
 }
 
-std::vector<float> RNDGameState::get_observation() const {
-    int channel_length = board.cols * board.rows;
-    std::vector<float> obs(kNumVisibleCellType * channel_length, 0);
+template <typename Dims>
+void RNDGameStateImpl<Dims>::write_observation(float *dst) const {
+    int channel_length = Cols() * Rows();
+    std::fill(dst, dst + observation_size(), 0.0f);
     for (int i = 0; i < channel_length; ++i) {
-        obs[static_cast<std::underlying_type_t<VisibleCellType>>(GetItem(i).visible_type) * channel_length + i] = 1;
+        dst[static_cast<std::underlying_type_t<VisibleCellType>>(GetItem(i).visible_type) * channel_length + i] = 1;
     }
-    return obs;
 }
 
-std::vector<uint8_t> RNDGameState::board_to_image(const std::vector<int8_t> &board, int rows, int cols) {
-    int flat_size = cols * rows;
-    std::vector<uint8_t> img(flat_size * 32 * 32 * 3, 0);
-    for (int h = 0; h < rows; ++h) {
-        for (int w = 0; w < cols; ++w) {
-            int img_idx_top_left = h * (32 * 32 * 3 * cols) + (w * 32 * 3);
-            VisibleCellType el = static_cast<VisibleCellType>(board[h * cols + w]);
-            const std::vector<uint8_t> &data = img_asset_map.at(el);
-            for (int r = 0; r < 32; ++r) {
-                for (int c = 0; c < 32; ++c) {
-                    int data_idx = (r * 3 * 32) + (3 * c);
-                    int img_idx = (r * 32 * 3 * cols) + (3 * c) + img_idx_top_left;
-                    img[img_idx + 0] = data[data_idx + 0];
-                    img[img_idx + 1] = data[data_idx + 1];
-                    img[img_idx + 2] = data[data_idx + 2];
-                }
-            }
-        }
+template <typename Dims>
+void RNDGameStateImpl<Dims>::write_cell_types(int8_t *dst) const {
+    for (int i = 0; i < Cols() * Rows(); ++i) {
+        dst[i] = static_cast<int8_t>(GetItem(i).visible_type);
     }
-    return img;
 }
 
-std::vector<uint8_t> RNDGameState::to_image() const {
-    int flat_size = board.cols * board.rows;
-    std::vector<uint8_t> img(flat_size * 32 * 32 * 3, 0);
-    for (int h = 0; h < board.rows; ++h) {
-        for (int w = 0; w < board.cols; ++w) {
-            int img_idx_top_left = h * (32 * 32 * 3 * board.cols) + (w * 32 * 3);
-            const std::vector<uint8_t> &data = img_asset_map.at(GetItem(h * board.cols + w).visible_type);
-            for (int r = 0; r < 32; ++r) {
-                for (int c = 0; c < 32; ++c) {
-                    int data_idx = (r * 3 * 32) + (3 * c);
-                    int img_idx = (r * 32 * 3 * board.cols) + (3 * c) + img_idx_top_left;
-                    img[img_idx + 0] = data[data_idx + 0];
-                    img[img_idx + 1] = data[data_idx + 1];
-                    img[img_idx + 2] = data[data_idx + 2];
-                }
-            }
-        }
+template <typename Dims>
+std::vector<uint8_t> RNDGameStateImpl<Dims>::board_to_image(const std::vector<int8_t> &board, int rows, int cols) {
+    if (rows <= 0 || cols <= 0 || (int)board.size() < rows * cols) {
+        throw std::invalid_argument("Board is smaller than the given dimensions");
     }
+    std::vector<uint8_t> img(stonesngems::image_size(rows, cols));
+    render_image(board.data(), rows, cols, img.data());
     return img;
 }
 
-uint64_t RNDGameState::get_reward_signal() const {
+template <typename Dims>
+std::vector<uint8_t> RNDGameStateImpl<Dims>::to_image() const {
+    std::vector<uint8_t> img(image_size());
+    write_image(img.data());
+    return img;
+}
+
+template <typename Dims>
+int RNDGameStateImpl<Dims>::image_size() const {
+    return (int)stonesngems::image_size(Rows(), Cols());
+}
+
+template <typename Dims>
+void RNDGameStateImpl<Dims>::write_image(uint8_t *dst) const {
+    std::array<int8_t, Dims::kCells> cell_types;    // On the stack, as frames are rendered repeatedly
+    write_cell_types(cell_types.data());
+    render_image(cell_types.data(), Rows(), Cols(), dst);
+}
+
+template <typename Dims>
+uint64_t RNDGameStateImpl<Dims>::get_reward_signal() const {
     return local_state.reward_signal;
 }
 
-uint64_t RNDGameState::get_hash() const {
+template <typename Dims>
+uint64_t RNDGameStateImpl<Dims>::get_hash() const {
     return board.zorb_hash;
 }
 
-std::vector<std::pair<int, int>> RNDGameState::get_positions(HiddenCellType element) const {
+template <typename Dims>
+std::vector<std::pair<int, int>> RNDGameStateImpl<Dims>::get_positions(HiddenCellType element) const {
     std::vector<std::pair<int, int>> indices;
     for (const auto &idx : board.find_all(static_cast<std::underlying_type_t<HiddenCellType>>(element))) {
-        indices.push_back({idx / board.cols, idx % board.cols});
+        indices.push_back({idx / Cols(), idx % Cols()});
     }
     return indices;
 }
 
-int RNDGameState::position_to_index(const std::pair<int, int> &position) const {
-    return position.first * board.cols + position.second;
+template <typename Dims>
+int RNDGameStateImpl<Dims>::position_to_index(const std::pair<int, int> &position) const {
+    return position.first * Cols() + position.second;
 }
 
-std::pair<int, int> RNDGameState::index_to_position(int index) const {
-    return {index / board.cols, index % board.cols};
+template <typename Dims>
+std::pair<int, int> RNDGameStateImpl<Dims>::index_to_position(int index) const {
+    return {index / Cols(), index % Cols()};
 }
 
-std::vector<int> RNDGameState::get_indices(HiddenCellType element) const {
+template <typename Dims>
+std::vector<int> RNDGameStateImpl<Dims>::get_indices(HiddenCellType element) const {
     std::vector<int> indices;
     for (const auto &idx : board.find_all(static_cast<std::underlying_type_t<HiddenCellType>>(element))) {
         indices.push_back(idx);
@@ -259,23 +437,35 @@ std::vector<int> RNDGameState::get_indices(HiddenCellType element) const {
     return indices;
 }
 
-bool RNDGameState::is_pos_in_bounds(const std::pair<int, int> &position) const {
-    return position.first >= 0 && position.second >= 0 && position.first < board.rows && position.second < board.cols;
+template <typename Dims>
+bool RNDGameStateImpl<Dims>::is_pos_in_bounds(const std::pair<int, int> &position) const {
+    return position.first >= 0 && position.second >= 0 && position.first < Rows() && position.second < Cols();
 }
 
-int RNDGameState::get_index_id(int index) const {
-    auto iter = local_state.index_id_map.find(index);
-    return iter == local_state.index_id_map.end() ? -1 : static_cast<int>(iter->second);
+template <typename Dims>
+int RNDGameStateImpl<Dims>::get_index_id(int index) const {
+    IDType id = local_state.index_ids[index];
+    return id == LocalStateType::kNoID ? -1 : static_cast<int>(id);
 }
 
-int RNDGameState::get_id_index(int id) const {
-    auto iter = local_state.id_index_map.find(static_cast<LocalState::id_type>(id));
-    return iter == local_state.id_index_map.end() ? -1 : iter->second;
+template <typename Dims>
+int RNDGameStateImpl<Dims>::get_id_index(int id) const {
+    // IDs are only tracked by index, as a reverse table would add to the size of every state copy
+    if (id == LocalStateType::kNoID) {
+        return -1;
+    }
+    for (int i = 0; i < Rows() * Cols(); ++i) {
+        if (local_state.index_ids[i] == static_cast<IDType>(id)) {
+            return i;
+        }
+    }
+    return -1;
 }
 
-std::unordered_set<RewardCodes> RNDGameState::get_valid_rewards() const {
+template <typename Dims>
+std::unordered_set<RewardCodes> RNDGameStateImpl<Dims>::get_valid_rewards() const {
     std::unordered_set<RewardCodes> reward_codes;
-    for (int i = 0; i < (int)board.grid.size(); ++i) {
+    for (int i = 0; i < Rows() * Cols(); ++i) {
         HiddenCellType el = static_cast<HiddenCellType>(board.grid[i]);
         if (kElementToRewardMap.find(el) != kElementToRewardMap.end()) {
             reward_codes.insert(kElementToRewardMap.at(el));
@@ -284,23 +474,28 @@ std::unordered_set<RewardCodes> RNDGameState::get_valid_rewards() const {
     return reward_codes;
 }
 
-int RNDGameState::get_agent_pos() const {
+template <typename Dims>
+int RNDGameStateImpl<Dims>::get_agent_pos() const {
     return board.agent_pos;
 }
 
-int RNDGameState::get_agent_index() const {
+template <typename Dims>
+int RNDGameStateImpl<Dims>::get_agent_index() const {
     return board.agent_idx;
 }
 
-int8_t RNDGameState::get_index_item(int index) const {
+template <typename Dims>
+int8_t RNDGameStateImpl<Dims>::get_index_item(int index) const {
     return board.item(index);
 }
 
-HiddenCellType RNDGameState::get_hidden_item(int index) const {
+template <typename Dims>
+HiddenCellType RNDGameStateImpl<Dims>::get_hidden_item(int index) const {
     return static_cast<HiddenCellType>(board.item(index));
 }
 
-std::ostream &operator<<(std::ostream &os, const RNDGameState &state) {
+template <typename Dims>
+std::ostream &operator<<(std::ostream &os, const RNDGameStateImpl<Dims> &state) {
     for (int h = 0; h < state.board.rows; ++h) {
         for (int w = 0; w < state.board.cols; ++w) {
             os << kCellTypeToElement[state.board.grid[h * state.board.cols + w] + 1].id;
@@ -313,89 +508,97 @@ std::ostream &operator<<(std::ostream &os, const RNDGameState &state) {
 // ---------------------------------------------------------------------------
 
 // Not safe, assumes InBounds has been called (or used in conjunction)
-int RNDGameState::IndexFromAction(int index, int action) const {
+template <typename Dims>
+int RNDGameStateImpl<Dims>::IndexFromAction(int index, int action) const {
     switch (action) {
         case Directions::kNoop:
             return index;
         case Directions::kUp:
-            return index - board.cols;
+            return index - Cols();
         case Directions::kRight:
             return index + 1;
         case Directions::kDown:
-            return index + board.cols;
+            return index + Cols();
         case Directions::kLeft:
             return index - 1;
         case Directions::kUpRight:
-            return index - board.cols + 1;
+            return index - Cols() + 1;
         case Directions::kDownRight:
-            return index + board.cols + 1;
+            return index + Cols() + 1;
         case Directions::kUpLeft:
-            return index - board.cols - 1;
+            return index - Cols() - 1;
         case Directions::kDownLeft:
-            return index + board.cols - 1;
+            return index + Cols() - 1;
         default:
             __builtin_unreachable();
     }
 }
-int RNDGameState::BoundsIndexFromAction(int index, int action) const {
+template <typename Dims>
+int RNDGameStateImpl<Dims>::BoundsIndexFromAction(int index, int action) const {
     switch (action) {
         case Directions::kNoop:
             return index;
         case Directions::kUp:
-            return index - (board.cols + 2);
+            return index - (Cols() + 2);
         case Directions::kRight:
             return index + 1;
         case Directions::kDown:
-            return index + (board.cols + 2);
+            return index + (Cols() + 2);
         case Directions::kLeft:
             return index - 1;
         case Directions::kUpRight:
-            return index - (board.cols + 2) + 1;
+            return index - (Cols() + 2) + 1;
         case Directions::kDownRight:
-            return index + (board.cols + 2) + 1;
+            return index + (Cols() + 2) + 1;
         case Directions::kUpLeft:
-            return index - (board.cols + 2) - 1;
+            return index - (Cols() + 2) - 1;
         case Directions::kDownLeft:
-            return index + (board.cols + 2) - 1;
+            return index + (Cols() + 2) - 1;
         default:
             __builtin_unreachable();
     }
 }
 
-bool RNDGameState::InBounds(int index, int action) const {
-    return shared_state_ptr->in_bounds_board[BoundsIndexFromAction(shared_state_ptr->board_to_inbounds[index], action)];
+template <typename Dims>
+bool RNDGameStateImpl<Dims>::InBounds(int index, int action) const {
+    if constexpr (Dims::kFixed) {
+        return Dims::kInBoundsBoard[BoundsIndexFromAction(Dims::kBoardToInbounds[index], action)];
+    } else {
+        return shared_state_ptr->in_bounds_board[BoundsIndexFromAction(shared_state_ptr->board_to_inbounds[index],
+                                                                       action)];
+    }
 }
 
-bool RNDGameState::IsType(int index, const Element &element, int action) const {
+template <typename Dims>
+bool RNDGameStateImpl<Dims>::IsType(int index, const Element &element, int action) const {
     int new_index = IndexFromAction(index, action);
     return InBounds(index, action) && GetItem(new_index) == element;
 }
 
-bool RNDGameState::HasProperty(int index, int property, int action) const {
+template <typename Dims>
+bool RNDGameStateImpl<Dims>::HasProperty(int index, int property, int action) const {
     int new_index = IndexFromAction(index, action);
     return InBounds(index, action) && ((GetItem(new_index).properties & property) > 0);
 }
 
-void RNDGameState::UpdateIDIndex(int index_old, int index_new) {
-    if (local_state.index_id_map.find(index_old) != local_state.index_id_map.end()) {
-        auto id = local_state.index_id_map.at(index_old);
-        local_state.index_id_map.erase(index_old);
-        local_state.index_id_map[index_new] = id;
-        local_state.id_index_map[id] = index_new;
+template <typename Dims>
+void RNDGameStateImpl<Dims>::UpdateIDIndex(int index_old, int index_new) {
+    IDType id = local_state.index_ids[index_old];
+    if (id != LocalStateType::kNoID) {
+        local_state.index_ids[index_old] = LocalStateType::kNoID;
+        local_state.index_ids[index_new] = id;
     }
 }
 
-void RNDGameState::UpdateIndexID(int index) {
-    if (local_state.index_id_map.find(index) != local_state.index_id_map.end()) {
-        auto id_old = local_state.index_id_map.at(index);
-        auto id_new = ++local_state.id_state;
-        local_state.id_index_map.erase(id_old);
-        local_state.id_index_map[id_new] = index;
-        local_state.index_id_map[index] = id_new;
+template <typename Dims>
+void RNDGameStateImpl<Dims>::UpdateIndexID(int index) {
+    if (local_state.index_ids[index] != LocalStateType::kNoID) {
+        local_state.index_ids[index] = NextID();
     }
 }
 
-void RNDGameState::AddIndexID(int index) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::AddIndexID(int index) {
     switch (board.item(index)) {
         case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kStone):
         case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kStoneFalling):
@@ -403,9 +606,7 @@ void RNDGameState::AddIndexID(int index) {
         case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kDiamondFalling):
         case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kNut):
         case static_cast<std::underlying_type_t<HiddenCellType>>(HiddenCellType::kNutFalling): {
-            auto id = ++local_state.id_state;
-            local_state.id_index_map[id] = index;
-            local_state.index_id_map[index] = id;
+            local_state.index_ids[index] = NextID();
             break;
         }
         default:
@@ -413,74 +614,119 @@ void RNDGameState::AddIndexID(int index) {
     }
 }
 
-void RNDGameState::RemoveIndexID(int index) {
-    if (local_state.index_id_map.find(index) != local_state.index_id_map.end()) {
-        auto id = local_state.index_id_map.at(index);
-        local_state.id_index_map.erase(id);
-        local_state.index_id_map.erase(index);
+template <typename Dims>
+void RNDGameStateImpl<Dims>::RemoveIndexID(int index) {
+    local_state.index_ids[index] = LocalStateType::kNoID;
+}
+
+// kNoID marks untracked indices, so it is skipped if the counter wraps
+template <typename Dims>
+auto RNDGameStateImpl<Dims>::NextID() -> IDType {
+    if (++local_state.id_state == LocalStateType::kNoID) {
+        ++local_state.id_state;
     }
+    return local_state.id_state;
 }
 
-void RNDGameState::MoveItem(int index, int action) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::MoveItem(int index, int action) {
     int new_index = IndexFromAction(index, action);
-    board.zorb_hash ^= shared_state_ptr->zrbht.at((board.item(new_index) * board.cols * board.rows) + new_index);
+    board.zorb_hash ^= shared_state_ptr->zrbht[(board.item(new_index) * Cols() * Rows()) + new_index];
     board.item(new_index) = board.item(index);
-    board.zorb_hash ^= shared_state_ptr->zrbht.at((board.item(new_index) * board.cols * board.rows) + new_index);
+    board.zorb_hash ^= shared_state_ptr->zrbht[(board.item(new_index) * Cols() * Rows()) + new_index];
     // grid_.ids[new_index] = grid_.ids[index];
 
-    board.zorb_hash ^= shared_state_ptr->zrbht.at((board.item(index) * board.cols * board.rows) + index);
+    board.zorb_hash ^= shared_state_ptr->zrbht[(board.item(index) * Cols() * Rows()) + index];
     board.item(index) = ElementToItem(kElEmpty);
-    board.zorb_hash ^= shared_state_ptr->zrbht.at((ElementToItem(kElEmpty) * board.cols * board.rows) + index);
-    board.has_updated[new_index] = true;
+    board.zorb_hash ^= shared_state_ptr->zrbht[(ElementToItem(kElEmpty) * Cols() * Rows()) + index];
+    board.has_updated.set(new_index);
+    board.active.set(new_index, CanUpdate(board.item(new_index)));
+    board.active.set(index, false);
+    WakeNeighbours(index);
+    WakeNeighbours(new_index);
     // grid_.ids[index] = ++id_counter_;
 
     // Update ID
     UpdateIDIndex(index, new_index);
 }
 
-void RNDGameState::SetItem(int index, const Element &element, int id, int action) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::SetItem(int index, const Element &element, int id, int action) {
     (void)id;
     int new_index = IndexFromAction(index, action);
-    board.zorb_hash ^= shared_state_ptr->zrbht.at((board.item(new_index) * board.cols * board.rows) + new_index);
+    board.zorb_hash ^= shared_state_ptr->zrbht[(board.item(new_index) * Cols() * Rows()) + new_index];
     board.item(new_index) = ElementToItem(element);
-    board.zorb_hash ^= shared_state_ptr->zrbht.at((ElementToItem(element) * board.cols * board.rows) + new_index);
+    board.zorb_hash ^= shared_state_ptr->zrbht[(ElementToItem(element) * Cols() * Rows()) + new_index];
     // grid_.ids[new_index] = id;
-    board.has_updated[new_index] = true;
+    board.has_updated.set(new_index);
+    board.active.set(new_index, CanUpdate(ElementToItem(element)));
+    WakeNeighbours(new_index);
+}
+
+// Reactivate the items around a changed cell, as settled items only depend on the cells around them. Wrapping past
+// the board edges just wakes a few extra cells.
+template <typename Dims>
+void RNDGameStateImpl<Dims>::WakeNeighbours(int index) {
+    const int num_cells = Rows() * Cols();
+    for (int row_offset = -Cols(); row_offset <= Cols(); row_offset += Cols()) {
+        for (int i = index + row_offset - 1; i <= index + row_offset + 1; ++i) {
+            if (i >= 0 && i < num_cells && i != index && CanUpdate(board.item(i))) {
+                board.active.set(i);
+            }
+        }
+    }
+}
+
+// Reactivate the closed exits once enough gems are collected, as they settle while waiting
+template <typename Dims>
+void RNDGameStateImpl<Dims>::WakeClosedExits() {
+    for (int i = 0; i < Rows() * Cols(); ++i) {
+        if (board.item(i) == ElementToItem(kElExitClosed)) {
+            board.active.set(i);
+        }
+    }
 }
 
-const Element &RNDGameState::GetItem(int index, int action) const {
+template <typename Dims>
+const Element &RNDGameStateImpl<Dims>::GetItem(int index, int action) const {
     int new_index = IndexFromAction(index, action);
     return kCellTypeToElement[board.item(new_index) + 1];
 }
 
-bool RNDGameState::IsTypeAdjacent(int index, const Element &element) const {
+template <typename Dims>
+bool RNDGameStateImpl<Dims>::IsTypeAdjacent(int index, const Element &element) const {
     return IsType(index, element, Directions::kUp) || IsType(index, element, Directions::kLeft) ||
            IsType(index, element, Directions::kDown) || IsType(index, element, Directions::kRight);
 }
 
 // ---------------------------------------------------------------------------
 
-bool RNDGameState::CanRollLeft(int index) const {
+template <typename Dims>
+bool RNDGameStateImpl<Dims>::CanRollLeft(int index) const {
     return HasProperty(index, ElementProperties::kRounded, Directions::kDown) &&
            IsType(index, kElEmpty, Directions::kLeft) && IsType(index, kElEmpty, Directions::kDownLeft);
 }
 
-bool RNDGameState::CanRollRight(int index) const {
+template <typename Dims>
+bool RNDGameStateImpl<Dims>::CanRollRight(int index) const {
     return HasProperty(index, ElementProperties::kRounded, Directions::kDown) &&
            IsType(index, kElEmpty, Directions::kRight) && IsType(index, kElEmpty, Directions::kDownRight);
 }
 
-void RNDGameState::RollLeft(int index, const Element &element) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::RollLeft(int index, const Element &element) {
     SetItem(index, element, -1);
     MoveItem(index, Directions::kLeft);
 }
 
-void RNDGameState::RollRight(int index, const Element &element) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::RollRight(int index, const Element &element) {
     SetItem(index, element, -1);
     MoveItem(index, Directions::kRight);
 }
 
-void RNDGameState::Push(int index, const Element &stationary, const Element &falling, int action) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::Push(int index, const Element &stationary, const Element &falling, int action) {
     int new_index = IndexFromAction(index, action);
     // Check if same direction past element is empty so that theres room to push
     if (IsType(new_index, kElEmpty, action)) {
@@ -497,7 +743,8 @@ void RNDGameState::Push(int index, const Element &stationary, const Element &fal
     }
 }
 
-void RNDGameState::MoveThroughMagic(int index, const Element &element) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::MoveThroughMagic(int index, const Element &element) {
     // Check if magic wall is still active
     if (local_state.magic_wall_steps <= 0) {
         return;
@@ -513,7 +760,8 @@ void RNDGameState::MoveThroughMagic(int index, const Element &element) {
     }
 }
 
-void RNDGameState::Explode(int index, const Element &element, int action) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::Explode(int index, const Element &element, int action) {
     int new_index = IndexFromAction(index, action);
     auto it = kElementToExplosion.find(GetItem(new_index));
     const Element &ex = (it == kElementToExplosion.end()) ? kElExplosionEmpty : it->second;
@@ -540,7 +788,8 @@ void RNDGameState::Explode(int index, const Element &element, int action) {
 
 // ---------------------------------------------------------------------------
 
-void RNDGameState::UpdateStone(int index) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::UpdateStone(int index) {
     // If no gravity, do nothing
     if (!shared_state_ptr->gravity) {
         return;
@@ -557,7 +806,8 @@ void RNDGameState::UpdateStone(int index) {
     }
 }
 
-void RNDGameState::UpdateStoneFalling(int index) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::UpdateStoneFalling(int index) {
     // Continue to fall as normal
     if (IsType(index, kElEmpty, Directions::kDown)) {
         MoveItem(index, Directions::kDown);
@@ -586,7 +836,8 @@ void RNDGameState::UpdateStoneFalling(int index) {
     }
 }
 
-void RNDGameState::UpdateDiamond(int index) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::UpdateDiamond(int index) {
     // If no gravity, do nothing
     if (!shared_state_ptr->gravity) {
         return;
@@ -603,7 +854,8 @@ void RNDGameState::UpdateDiamond(int index) {
     }
 }
 
-void RNDGameState::UpdateDiamondFalling(int index) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::UpdateDiamondFalling(int index) {
     // Continue to fall as normal
     if (IsType(index, kElEmpty, Directions::kDown)) {
         MoveItem(index, Directions::kDown);
@@ -625,7 +877,8 @@ void RNDGameState::UpdateDiamondFalling(int index) {
     }
 }
 
-void RNDGameState::UpdateNut(int index) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::UpdateNut(int index) {
     // If no gravity, do nothing
     if (!shared_state_ptr->gravity) {
         return;
@@ -642,7 +895,8 @@ void RNDGameState::UpdateNut(int index) {
     }
 }
 
-void RNDGameState::UpdateNutFalling(int index) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::UpdateNutFalling(int index) {
     // Continue to fall as normal
     if (IsType(index, kElEmpty, Directions::kDown)) {
         MoveItem(index, Directions::kDown);
@@ -656,7 +910,8 @@ void RNDGameState::UpdateNutFalling(int index) {
     }
 }
 
-void RNDGameState::UpdateBomb(int index) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::UpdateBomb(int index) {
     // If no gravity, do nothing
     if (!shared_state_ptr->gravity) {
         return;
@@ -673,7 +928,8 @@ void RNDGameState::UpdateBomb(int index) {
     }
 }
 
-void RNDGameState::UpdateBombFalling(int index) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::UpdateBombFalling(int index) {
     // Continue to fall as normal
     if (IsType(index, kElEmpty, Directions::kDown)) {
         MoveItem(index, Directions::kDown);
@@ -688,14 +944,16 @@ void RNDGameState::UpdateBombFalling(int index) {
     }
 }
 
-void RNDGameState::UpdateExit(int index) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::UpdateExit(int index) {
     // Open exit if enough gems collected
     if (local_state.gems_collected >= board.gems_required) {
         SetItem(index, kElExitOpen, -1);
     }
 }
 
-void RNDGameState::UpdateAgent(int index, int action) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::UpdateAgent(int index, int action) {
     // If action results not in bounds, don't do anything
     if (!InBounds(index, action)) {
         return;
@@ -707,6 +965,9 @@ void RNDGameState::UpdateAgent(int index, int action) {
         board.agent_idx = IndexFromAction(index, action);
     } else if (IsType(index, kElDiamond, action) || IsType(index, kElDiamondFalling, action)) {    // Collect gems
         ++local_state.gems_collected;
+        if (local_state.gems_collected == board.gems_required) {
+            WakeClosedExits();
+        }
         local_state.current_reward += kPointMap.at(GetItem(index, action).cell_type);
         local_state.reward_signal |= RewardCodes::kRewardCollectDiamond;
         MoveItem(index, action);
@@ -732,6 +993,9 @@ void RNDGameState::UpdateAgent(int index, int action) {
             // Correct for landing on traversable elements
             if (IsType(index_gate, kElDiamond, action) || IsType(index_gate, kElDiamondFalling, action)) {
                 ++local_state.gems_collected;
+                if (local_state.gems_collected == board.gems_required) {
+                    WakeClosedExits();
+                }
                 local_state.current_reward += kPointMap.at(GetItem(index_gate, action).cell_type);
                 local_state.reward_signal |= RewardCodes::kRewardCollectDiamond;
             } else if (IsKey(GetItem(index_gate, action))) {
@@ -759,7 +1023,8 @@ void RNDGameState::UpdateAgent(int index, int action) {
     }
 }
 
-void RNDGameState::UpdateFirefly(int index, int action) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::UpdateFirefly(int index, int action) {
     int new_dir = kRotateLeft[action];
     if (IsTypeAdjacent(index, kElAgent) || IsTypeAdjacent(index, kElBlob)) {
         // Explode if touching the agent/blob
@@ -778,7 +1043,8 @@ void RNDGameState::UpdateFirefly(int index, int action) {
     }
 }
 
-void RNDGameState::UpdateButterfly(int index, int action) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::UpdateButterfly(int index, int action) {
     int new_dir = kRotateRight[action];
     if (IsTypeAdjacent(index, kElAgent) || IsTypeAdjacent(index, kElBlob)) {
         // Explode if touching the agent/blob
@@ -797,7 +1063,8 @@ void RNDGameState::UpdateButterfly(int index, int action) {
     }
 }
 
-void RNDGameState::UpdateOrange(int index, int action) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::UpdateOrange(int index, int action) {
     if (IsType(index, kElEmpty, action)) {
         // Continue moving in direction
         MoveItem(index, action);
@@ -824,7 +1091,8 @@ void RNDGameState::UpdateOrange(int index, int action) {
     }
 }
 
-void RNDGameState::UpdateMagicWall(int index) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::UpdateMagicWall(int index) {
     // Dorminant, active, then expired once time runs out
     if (local_state.magic_active) {
         SetItem(index, kElWallMagicOn, -1);
@@ -835,7 +1103,8 @@ void RNDGameState::UpdateMagicWall(int index) {
     }
 }
 
-void RNDGameState::UpdateBlob(int index) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::UpdateBlob(int index) {
     // Replace blobs if swap element set
     if (local_state.blob_swap != ElementToItem(kNullElement)) {
         SetItem(index, kCellTypeToElement[local_state.blob_swap + 1], -1);
@@ -857,12 +1126,14 @@ void RNDGameState::UpdateBlob(int index) {
     }
 }
 
-void RNDGameState::UpdateExplosions(int index) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::UpdateExplosions(int index) {
     SetItem(index, kExplosionToElement.at(GetItem(index)), -1);
     AddIndexID(index);
 }
 
-void RNDGameState::OpenGate(const Element &element) {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::OpenGate(const Element &element) {
     std::vector<int> closed_gate_indices = board.find_all(ElementToItem(element));
     for (const auto &index : closed_gate_indices) {
         SetItem(index, kGateOpenMap.at(GetItem(index)), -1);
@@ -871,7 +1142,8 @@ void RNDGameState::OpenGate(const Element &element) {
 
 // ---------------------------------------------------------------------------
 
-void RNDGameState::StartScan() {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::StartScan() {
     if (local_state.steps_remaining > 0) {
         local_state.steps_remaining += -1;
     }
@@ -882,7 +1154,8 @@ void RNDGameState::StartScan() {
     board.reset_updated();
 }
 
-void RNDGameState::EndScan() {
+template <typename Dims>
+void RNDGameStateImpl<Dims>::EndScan() {
     if (local_state.blob_swap == ElementToItem(kNullElement)) {
         if (local_state.blob_enclosed) {
             local_state.blob_swap = ElementToItem(kElDiamond);
@@ -897,4 +1170,14 @@ void RNDGameState::EndScan() {
     local_state.magic_active = local_state.magic_active && (local_state.magic_wall_steps > 0);
 }
 
+// ---------------------------------------------------------------------------
+
+// Supported dimensions, add to these (and the extern declarations in the header) for other fixed sizes
+template class RNDGameStateImpl<DynamicDims>;
+template class RNDGameStateImpl<FixedDims<16, 16>>;
+template class RNDGameStateImpl<FixedDims<32, 32>>;
+template std::ostream &operator<<(std::ostream &os, const RNDGameStateImpl<DynamicDims> &state);
+template std::ostream &operator<<(std::ostream &os, const RNDGameStateImpl<FixedDims<16, 16>> &state);
+template std::ostream &operator<<(std::ostream &os, const RNDGameStateImpl<FixedDims<32, 32>> &state);
+
 }    // namespace stonesngems
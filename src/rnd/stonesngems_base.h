@@ -6,6 +6,7 @@
 #include <memory>
 #include <random>
 #include <string>
+#include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 #include <variant>
@@ -33,6 +34,8 @@ static const GameParameters kDefaultGameParams{
 };
 
 // Shared global state information relevant to all states for the given game
+// Set up the first time a state is constructed from a given set of parameters and board dimensions, and read only
+// afterwards. The board itself isn't part of it, so levels of the same dimensions share the tables.
 struct SharedStateInfo {
     SharedStateInfo(const GameParameters &params)
         : params(params),
@@ -42,25 +45,24 @@ struct SharedStateInfo {
           blob_max_size(0),
           blob_max_percentage(std::get<float>(params.at("blob_max_percentage"))),
           rng_seed(std::get<int>(params.at("rng_seed"))),
-          game_board_str(std::get<std::string>(params.at("game_board_str"))),
           gravity(std::get<bool>(params.at("gravity"))) {}
-    GameParameters params;                      // Copy of game parameters for state resetting
+    GameParameters params;                      // Copy of game parameters, without the board string
     bool obs_show_ids;                          // Flag to show object IDs (currently not used)
     uint16_t magic_wall_steps;                  // Number of steps the magic wall stays active for
     uint8_t blob_chance;                        // Chance (out of 256) for blob to spawn
     uint16_t blob_max_size;                     // Max blob size in terms of grid spaces
     float blob_max_percentage;                  // Max blob size as percentage of map size
     int rng_seed;                               // Seed
-    std::string game_board_str;                 // String representation of the starting state
     bool gravity;                               // Flag if gravity is on, affects stones/gems
-    std::unordered_map<int, uint64_t> zrbht;    // Zobrist hashing table
+    std::vector<uint64_t> zrbht;                // Zobrist hashing table, indexed by item * cells + index
     std::vector<bool> in_bounds_board;          // Fast check for single-step in bounds
     std::vector<int> board_to_inbounds;         // Indexing conversion for in bounds checking
 };
 
-// Information specific for the current game state
-struct LocalState {
-    LocalState()
+// Information specific for the current game state, tracking IDs for up to Capacity cells
+template <int Capacity>
+struct LocalStateT {
+    LocalStateT()
         : magic_wall_steps(0),
           blob_size(0),
           blob_swap(-1),
@@ -73,35 +75,98 @@ struct LocalState {
           random_state(1),
           id_state(0) {}
 
-    bool operator==(const LocalState &other) const {
+    bool operator==(const LocalStateT &other) const {
         return magic_wall_steps == other.magic_wall_steps && blob_size == other.blob_size &&
                gems_collected == other.gems_collected && magic_active == other.magic_active &&
                blob_enclosed == other.blob_enclosed;
     }
     using id_type = uint16_t;
+    static constexpr id_type kNoID = 0;    // IDs are handed out from 1
+
+    uint16_t magic_wall_steps;                          // Number of steps remaining for the magic wall
+    uint16_t blob_size;                                 // Current size of the blob
+    int8_t blob_swap;                                   // Swap element when the blob vanishes
+    uint8_t gems_collected;                             // Number of gems collected
+    uint8_t current_reward;                             // Reward for the current game state
+    uint64_t reward_signal;                             // Signal for external information about events
+    bool magic_active;                                  // Flag if magic wall is currently active
+    bool blob_enclosed;                                 // Flag if blob is enclosed
+    int steps_remaining;                                // Number of steps remaining (if timeout set)
+    uint64_t random_state;                              // State of Xorshift rng
+    uint16_t id_state;                                  // Current ID state
+    std::array<id_type, Capacity> index_ids{};          // Index to ID mapping, kNoID if the index is not tracked
+};
+
+using LocalState = LocalStateT<kMaxBoardCells>;
+
+// Board dimensions read from the board string at runtime, up to kMaxBoardCells cells
+struct DynamicDims {
+    static constexpr bool kFixed = false;
+    static constexpr int kCells = kMaxBoardCells;
+};
 
-    uint16_t magic_wall_steps;                        // Number of steps remaining for the magic wall
-    uint16_t blob_size;                               // Current size of the blob
-    int8_t blob_swap;                                 // Swap element when the blob vanishes
-    uint8_t gems_collected;                           // Number of gems collected
-    uint8_t current_reward;                           // Reward for the current game state
-    uint64_t reward_signal;                           // Signal for external information about events
-    bool magic_active;                                // Flag if magic wall is currently active
-    bool blob_enclosed;                               // Flag if blob is enclosed
-    int steps_remaining;                              // Number of steps remaining (if timeout set)
-    uint64_t random_state;                            // State of Xorshift rng
-    uint16_t id_state;                                // Current ID state
-    std::unordered_map<int, id_type> index_id_map;    // Index to ID mapping
-    std::unordered_map<id_type, int> id_index_map;    // ID to index mapping
+// Board dimensions fixed at compile time, so index math, bounds checks and observation sizes are constants
+template <int Rows, int Cols>
+struct FixedDims {
+    static constexpr bool kFixed = true;
+    static constexpr int kRows = Rows;
+    static constexpr int kCols = Cols;
+    static constexpr int kCells = Rows * Cols;
+
+    // Board padded by one cell on each side, true if in bounds
+    static constexpr std::array<bool, (Rows + 2) * (Cols + 2)> kInBoundsBoard = []() {
+        std::array<bool, (Rows + 2) * (Cols + 2)> in_bounds{};
+        for (int r = 1; r <= Rows; ++r) {
+            for (int c = 1; c <= Cols; ++c) {
+                in_bounds[r * (Cols + 2) + c] = true;
+            }
+        }
+        return in_bounds;
+    }();
+
+    // Board index to padded board index
+    static constexpr std::array<int, Rows * Cols> kBoardToInbounds = []() {
+        std::array<int, Rows * Cols> to_inbounds{};
+        for (int r = 0; r < Rows; ++r) {
+            for (int c = 0; c < Cols; ++c) {
+                to_inbounds[r * Cols + c] = (Cols + 2) * (r + 1) + c + 1;
+            }
+        }
+        return to_inbounds;
+    }();
 };
 
-// Game state
-class RNDGameState {
+// Game state, templated on how the board dimensions are known
+// The member definitions live in stonesngems_base.cpp, which instantiates the supported dimensions.
+template <typename Dims>
+class RNDGameStateImpl {
 public:
-    RNDGameState(const GameParameters &params = kDefaultGameParams);
+    using BoardType = BoardT<Dims::kCells>;
+    using LocalStateType = LocalStateT<Dims::kCells>;
+
+    /**
+     * The board string is parsed once into a store shared by all states started from it, until release_board().
+     * @param params Game parameters, for fixed dimensions the board string must match them
+     */
+    RNDGameStateImpl(const GameParameters &params = kDefaultGameParams);
+
+    /**
+     * Start from the given level rather than the board string of the parameters, which is ignored.
+     * @param params Game parameters
+     * @param level Starting layout, which must outlive the state as reset() returns to it
+     */
+    RNDGameStateImpl(const GameParameters &params, const util::LevelView &level);
+
+    /**
+     * Start from the given level, with the same game parameters as another state. The shared tables of the other
+     * state are reused if the level has the same dimensions, so nothing is parsed or allocated.
+     * @param other State whose game parameters are used
+     * @param level Starting layout, which must outlive the state as reset() returns to it
+     */
+    RNDGameStateImpl(const RNDGameStateImpl &other, const util::LevelView &level);
 
-    bool operator==(const RNDGameState &other) const;
-    bool operator!=(const RNDGameState &other) const;
+    bool operator==(const RNDGameStateImpl &other) const;
+    bool operator!=(const RNDGameStateImpl &other) const;
 
     /**
      * Reset the environment to the state as given by the GameParameters
@@ -114,6 +179,14 @@ public:
      */
     void apply_action(int action);
 
+    /**
+     * Write the result of every legal action into children, as if each child were a copy of this state with
+     * apply_action() called on it. Work which doesn't depend on the action is only done once, and actions which
+     * leave the agent in place reuse the result of kNoop rather than stepping the board again.
+     * @param children Indexed by action, every entry is written
+     */
+    void expand_all(std::array<RNDGameStateImpl, kNumActions> &children) const;
+
     /**
      * Check if the state is terminal, meaning either solution, timeout, or agent dies.
      * @return True if terminal, false otherwise
@@ -126,6 +199,10 @@ public:
      */
     bool is_solution() const;
 
+    // Every action is legal in every state
+    static constexpr std::array<int, kNumActions> kLegalActions{Directions::kNoop, Directions::kUp, Directions::kRight,
+                                                                Directions::kDown, Directions::kLeft};
+
     /**
      * Get the legal actions which can be applied in the state.
      * @return vector containing each actions available
@@ -145,6 +222,35 @@ public:
      */
     std::vector<float> get_observation() const;
 
+    /**
+     * Get the number of values in an observation.
+     * @return Number of floats written by write_observation()
+     */
+    int observation_size() const {
+        return kNumVisibleCellType * Rows() * Cols();
+    }
+
+    /**
+     * Write the observation into a caller owned buffer, in the same layout as get_observation().
+     * @param dst Buffer of at least observation_size() floats, every value is written
+     */
+    void write_observation(float *dst) const;
+
+    /**
+     * Get the number of values in a compact observation.
+     * @return Number of cell types written by write_cell_types()
+     */
+    int cell_types_size() const {
+        return Rows() * Cols();
+    }
+
+    /**
+     * Write the compact observation, the visible cell type of each cell (HW), which is one-hot expanded into the
+     * channels of the full observation.
+     * @param dst Buffer of at least cell_types_size() values
+     */
+    void write_cell_types(int8_t *dst) const;
+
     /**
      * Get the index corresponding to the given position
      * @return the flat index
@@ -163,6 +269,19 @@ public:
      */
     std::vector<uint8_t> to_image() const;
 
+    /**
+     * Get the number of bytes in the image of the current state.
+     * @return Number of bytes written by write_image()
+     */
+    int image_size() const;
+
+    /**
+     * Write the image into a caller owned buffer, in the same layout as to_image().
+     * To only redraw the cells changed since the previous frame, render write_cell_types() with an IncrementalRenderer.
+     * @param dst Buffer of at least image_size() bytes, every byte is written
+     */
+    void write_image(uint8_t *dst) const;
+
     static std::vector<uint8_t> board_to_image(const std::vector<int8_t> &board, int rows, int cols);
 
     /**
@@ -242,9 +361,27 @@ public:
      */
     HiddenCellType get_hidden_item(int index) const;
 
-    friend std::ostream &operator<<(std::ostream &os, const RNDGameState &state);
+    template <typename D>
+    friend std::ostream &operator<<(std::ostream &os, const RNDGameStateImpl<D> &state);
 
 private:
+    using IDType = typename LocalStateType::id_type;
+
+    int Rows() const {
+        if constexpr (Dims::kFixed) {
+            return Dims::kRows;
+        } else {
+            return board.rows;
+        }
+    }
+    int Cols() const {
+        if constexpr (Dims::kFixed) {
+            return Dims::kCols;
+        } else {
+            return board.cols;
+        }
+    }
+
     int IndexFromAction(int index, int action) const;
     int BoundsIndexFromAction(int index, int action) const;
     bool InBounds(int index, int action = Directions::kNoop) const;
@@ -256,6 +393,8 @@ private:
     void RemoveIndexID(int index);
     void MoveItem(int index, int action);
     void SetItem(int index, const Element &element, int id, int action = Directions::kNoop);
+    void WakeNeighbours(int index);
+    void WakeClosedExits();
     const Element &GetItem(int index, int action = Directions::kNoop) const;
     bool IsTypeAdjacent(int index, const Element &element) const;
 
@@ -285,14 +424,47 @@ private:
     void UpdateExplosions(int index);
     void OpenGate(const Element &element);
 
+    void UpdateCell(int index);
+    void UpdateItems();    // Update all items other than the agent, in index order
     void StartScan();
     void EndScan();
+    IDType NextID();
+
+    void CheckDims() const;
 
-    std::shared_ptr<SharedStateInfo> shared_state_ptr;
-    Board board;
-    LocalState local_state;
+    const SharedStateInfo *shared_state_ptr;    // Owned by a store which lives for the rest of the process
+    util::LevelView start_level;                // Layout reset() returns to, see release_board()
+    BoardType board;
+    LocalStateType local_state;
 };
 
+template <typename Dims>
+std::ostream &operator<<(std::ostream &os, const RNDGameStateImpl<Dims> &state);
+
+/**
+ * Free the parsed board of a board string, which is otherwise kept once parsed so that states (which are trivially
+ * copyable) can view it. States started from the board string, and their copies, must not be used afterwards.
+ * States started from a level view don't use the store, the caller owns the level.
+ * @param board_str The game_board_str the states were started from
+ * @return True if the board was in the store
+ */
+bool release_board(const std::string &board_str);
+
+// Game state for boards of any size up to kMaxBoardCells
+using RNDGameState = RNDGameStateImpl<DynamicDims>;
+
+// Game state for boards of a fixed size, only the sizes instantiated in stonesngems_base.cpp can be used
+template <int Rows, int Cols>
+using RNDGameStateT = RNDGameStateImpl<FixedDims<Rows, Cols>>;
+
+extern template class RNDGameStateImpl<DynamicDims>;
+extern template class RNDGameStateImpl<FixedDims<16, 16>>;
+extern template class RNDGameStateImpl<FixedDims<32, 32>>;
+
+// States are copied for every child during search, so copies should stay a memcpy
+static_assert(std::is_trivially_copyable_v<RNDGameState>, "RNDGameState should be trivially copyable");
+static_assert(std::is_trivially_copyable_v<RNDGameStateT<16, 16>>, "RNDGameStateT should be trivially copyable");
+
 }    // namespace stonesngems
 
 #endif    // STONESNGEMS_BASE_H
@@ -1,6 +1,9 @@
-#include <cassert>
-#include <sstream>
+#include "util.h"
+
+#include <charconv>
+#include <stdexcept>
 #include <string>
+#include <system_error>
 #include <vector>
 
 #include "definitions.h"
@@ -8,36 +11,53 @@
 namespace stonesngems {
 namespace util {
 
-Board parse_board_str(const std::string &board_str) {
-    std::stringstream board_ss(board_str);
-    std::string segment;
-    std::vector<std::string> seglist;
-    // string split on |
-    while (std::getline(board_ss, segment, '|')) {
-        seglist.push_back(segment);
+namespace {
+
+// Parse the integer field starting at pos, moving pos past the field and its trailing separator
+int next_field(const std::string &board_str, std::size_t &pos) {
+    const char *first = board_str.data() + pos;
+    const char *last = board_str.data() + board_str.size();
+    int value = 0;
+    auto [ptr, ec] = std::from_chars(first, last, value);
+    if (ec != std::errc() || (ptr != last && *ptr != '|')) {
+        throw std::invalid_argument("Board string fields must be integers separated by |");
     }
+    pos = ptr - board_str.data() + (ptr != last ? 1 : 0);
+    return value;
+}
 
-    assert(seglist.size() >= 2);
+}    // namespace
 
-    // Get general info
-    int rows = std::stoi(seglist[0]);
-    int cols = std::stoi(seglist[1]);
-    assert((int)seglist.size() == rows * cols + 4);
-    int max_steps = std::stoi(seglist[2]);
-    int max_gems = std::stoi(seglist[3]);
-    Board board(rows, cols, static_cast<uint8_t>(max_gems), max_steps);
+BoardSpec parse_board_spec(const std::string &board_str) {
+    // Fields are read in place, as levels are parsed in bulk when loading datasets
+    std::size_t pos = 0;
+    BoardSpec spec;
+    spec.rows = next_field(board_str, pos);
+    spec.cols = next_field(board_str, pos);
+    spec.max_steps = next_field(board_str, pos);
+    spec.max_gems = next_field(board_str, pos);
+    if (spec.rows <= 0 || spec.cols <= 0) {
+        throw std::invalid_argument("Board string dimensions must be positive");
+    }
+    // Checked before reserving, where rows * cols could overflow, and no state can hold a larger board anyway
+    if ((int64_t)spec.rows * spec.cols > kMaxBoardCells) {
+        throw std::invalid_argument("Board string has more than " + std::to_string(kMaxBoardCells) + " cells");
+    }
 
     // Parse grid
-    for (std::size_t i = 4; i < seglist.size(); ++i) {
-        HiddenCellType el = static_cast<HiddenCellType>(std::stoi(seglist[i]));
-        board.item(i - 4) = static_cast<int8_t>(el);
-        if (el == HiddenCellType::kAgent) {
-            board.agent_pos = i - 4;
-            board.agent_idx = i - 4;
+    spec.grid.reserve(spec.rows * spec.cols);
+    while (pos < board_str.size()) {
+        const int cell = next_field(board_str, pos);
+        if (cell < 0 || cell >= kNumHiddenCellType) {
+            throw std::invalid_argument("Board string has an unknown cell type");
         }
+        spec.grid.push_back(static_cast<int8_t>(cell));
+    }
+    if ((int)spec.grid.size() != spec.rows * spec.cols) {
+        throw std::invalid_argument("Board string has the wrong number of cells for its dimensions");
     }
 
-    return board;
+    return spec;
 }
 
 }    // namespace util
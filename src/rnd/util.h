@@ -1,16 +1,72 @@
 #ifndef STONESNGEMS_UTIL_H
 #define STONESNGEMS_UTIL_H
 
+#include <cstdint>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
 #include "definitions.h"
 
 namespace stonesngems {
 namespace util {
 
-Board parse_board_str(const std::string &board_str);
+// Fields of a board string, before being placed into a board of a given capacity
+struct BoardSpec {
+    int rows;
+    int cols;
+    int max_steps;
+    int max_gems;
+    std::vector<int8_t> grid;
+};
+
+// Starting layout of a level, viewing a grid owned elsewhere (a BoardSpec or a mapped level pack)
+struct LevelView {
+    int rows;
+    int cols;
+    int max_steps;
+    int max_gems;
+    const int8_t *grid;    // rows * cols hidden cell types, row major
+};
+
+BoardSpec parse_board_spec(const std::string &board_str);
+
+/**
+ * View the layout held by a spec.
+ * @param spec The spec, which must outlive the view
+ * @return The view
+ */
+inline LevelView view_level(const BoardSpec &spec) {
+    return {spec.rows, spec.cols, spec.max_steps, spec.max_gems, spec.grid.data()};
+}
+
+template <int Capacity>
+BoardT<Capacity> board_from_level(const LevelView &level) {
+    if (level.rows * level.cols > Capacity) {
+        throw std::invalid_argument("Board has more cells than the board capacity");
+    }
+    BoardT<Capacity> board(level.rows, level.cols, static_cast<uint8_t>(level.max_gems), level.max_steps);
+    for (int i = 0; i < level.rows * level.cols; ++i) {
+        board.item(i) = level.grid[i];
+        if (static_cast<HiddenCellType>(level.grid[i]) == HiddenCellType::kAgent) {
+            board.agent_pos = i;
+            board.agent_idx = i;
+        }
+    }
+    return board;
+}
+
+template <int Capacity>
+BoardT<Capacity> parse_board_str(const std::string &board_str) {
+    const BoardSpec spec = parse_board_spec(board_str);
+    return board_from_level<Capacity>(view_level(spec));
+}
+
+inline Board parse_board_str(const std::string &board_str) {
+    return parse_board_str<kMaxBoardCells>(board_str);
+}
 
 }    // namespace util
 }    // namespace stonesngems
 
-#endif    // STONESNGEMS_UTIL_H
\ No newline at end of file
+#endif    // STONESNGEMS_UTIL_H
@@ -1,27 +1,25 @@
 #include "search.h"
 
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <chrono>
+#include <exception>
 #include <cmath>
+#include <condition_variable>
 #include <memory>
-#include <queue>
+#include <mutex>
 #include <string>
-#include <unordered_set>
+#include <utility>
 #include <vector>
 
-const int ALLOCATE_INCREMENT = 2000;
-const int BUDGET_NODES = 2000;
+#include "arena.h"
+#include "metrics.h"
+#include "open_list.h"
+#include "transposition_table.h"
 
-// Holds grounded state memory, nodes point to a state in this set (reduce duplicate memory)
-struct GroundedStateHash {
-    std::size_t operator()(const RNDGameState *state) const {
-        return state->get_hash();
-    }
-};
-
-struct GroundedStateCompareEqual {
-    bool operator()(const RNDGameState *left, const RNDGameState *right) const {
-        return *(left) == *(right);
-    }
-};
+const int ALLOCATE_INCREMENT = 2000;         // Block size of the reused node and state memory
+const bool VERIFY_TRANSPOSITIONS = true;    // Compare full states on Zobrist hash matches, guarding against collisions
 
 // Node used in search
 struct Node {
@@ -36,6 +34,14 @@ struct Node {
         action = action_;
     }
 
+    // Move the node onto another path to the same state, leaving the state untouched
+    void set_path(Node *parent_, double p_, double g_, int action_) {
+        parent = parent_;
+        p = p_;
+        g = g_;
+        action = action_;
+    }
+
     Node *parent;
     const RNDGameState *state;
     double p;
@@ -43,7 +49,8 @@ struct Node {
     double levin_cost = 0;
     int action = -1;
     double h = 0;
-    std::vector<double> action_log_policy;
+    int heap_index = -1;    // Position in the open list, if it tracks one
+    std::array<float, kNumActions> action_log_policy{};
 };
 
 // Compare function for nodes (f-cost, then g-cost on tiebreaks)
@@ -53,169 +60,725 @@ struct NodeCompareOrdered {
     }
 };
 
-// Node hash (state hash)
-struct NodeHash {
-    std::size_t operator()(const Node *node) const {
-        return node->state->get_hash();
-    }
-};
-
-// Node equality compare (underlying state) for closed
-struct NodeCompareEqual {
-    bool operator()(const Node *left, const Node *right) const {
-        return *(left->state) == *(right->state);
-    }
-};
-
 // Take log of policy and apply noise
-std::vector<double> log_policy_noise(const std::vector<double> &policy, double epsilon = 0) {
-    std::vector<double> log_policy;
+std::array<float, kNumActions> log_policy_noise(const Span<float> &policy, double epsilon = 0) {
+    assert(policy.size() == kNumActions);
+    std::array<float, kNumActions> log_policy;
     double noise = 1.0 / policy.size();
-    for (const auto p : policy) {
-        log_policy.push_back(std::log(((1.0 - epsilon) * p) + (epsilon * noise) + 1e-8));
+    for (int i = 0; i < kNumActions; ++i) {
+        log_policy[i] = std::log(((1.0 - epsilon) * policy[i]) + (epsilon * noise) + 1e-8);
     }
     return log_policy;
 }
 
-// Holds block allocation of states
-struct StateContainer {
-    using GroundedStateSet = std::unordered_set<const RNDGameState *, GroundedStateHash, GroundedStateCompareEqual>;
-    StateContainer() = delete;
-    StateContainer(const RNDGameState &state)
-        : init_state(state), states(1, std::vector<RNDGameState>(ALLOCATE_INCREMENT, state)) {}
-
-    void add_state(const RNDGameState &state) {
-        assert(idx < (int)states.back().size() - 1);
-        if (has_state(state)) {
-            return;
-        }
-
-        states.back()[++idx] = state;
-        state_set.insert(&states.back()[idx]);
+struct Node;
+using StateTable = TranspositionTable<RNDGameState, Node>;
 
-        // Init next block of memory
-        if (idx >= ALLOCATE_INCREMENT - 1) {
-            states.emplace_back(std::vector<RNDGameState>(ALLOCATE_INCREMENT, init_state));
-            idx = -1;
+// Holds block allocation of states, nodes point to a state in this set (reduce duplicate memory).
+// States are only copied in once they are first seen, and each has a single table entry tracking its search status.
+struct StateContainer {
+    StateContainer() : states(ALLOCATE_INCREMENT), table(2 * ALLOCATE_INCREMENT, VERIFY_TRANSPOSITIONS) {}
+
+    /**
+     * Find the entry for the state, storing a copy of the state if it hasn't been seen.
+     * @param state State to find or add
+     * @return The entry, only valid until the next state is added, and true if the state hadn't been seen
+     */
+    std::pair<StateTable::Entry *, bool> add_state(const RNDGameState &state) {
+        auto [entry, inserted] = table.insert(state.get_hash(), state);
+        if (inserted) {
+            entry->state = states.emplace(state);
         }
+        return {entry, inserted};
     }
 
-    bool has_state(const RNDGameState &state) {
-        return state_set.find(&state) != state_set.end();
+    /**
+     * Find the entry for a state which has already been added.
+     * @param state A state held by the container
+     * @return The entry, only valid until the next state is added
+     */
+    StateTable::Entry *get_entry(const RNDGameState &state) {
+        StateTable::Entry *entry = table.find(state.get_hash(), state);
+        assert(entry);
+        return entry;
     }
 
-    const RNDGameState *get_state(const RNDGameState &state) {
-        auto itr = state_set.find(&state);
-        return (itr == state_set.end()) ? nullptr : *itr;
+    // Drop all states, keeping the memory for the next search
+    void reset() {
+        table.clear();
+        states.reset();
     }
 
-    RNDGameState init_state;
-    std::vector<std::vector<RNDGameState>> states;
-    GroundedStateSet state_set;
-    int idx = -1;
+    Slab<RNDGameState> states;
+    StateTable table;
 };
 
 struct NodeBuffer {
+    NodeBuffer() : nodes(ALLOCATE_INCREMENT) {}
+
     Node *get_node() {
-        if (idx + 1 >= (int)nodes.size()) {
-            nodes.reserve(nodes.size() + ALLOCATE_INCREMENT);
-            for (int i = 0; i < ALLOCATE_INCREMENT; ++i) {
-                nodes.emplace_back(std::make_unique<Node>(nullptr, nullptr, 0, 0, 0, -1));
-            }
-        }
-        return nodes[++idx].get();
+        return nodes.emplace(nullptr, nullptr, 0, 0, 0, -1);
     }
-    std::vector<std::unique_ptr<Node>> nodes;
-    int idx = -1;
+
+    // Drop all nodes, keeping the memory for the next search
+    void reset() {
+        nodes.reset();
+    }
+
+    Slab<Node> nodes;
 };
 
+// The d-ary heap unless built with STD_OPEN_LIST, OPEN_LIST_ARITY sets the arity of the heap
+#ifndef OPEN_LIST_ARITY
+#define OPEN_LIST_ARITY 4
+#endif
+#ifdef STD_OPEN_LIST
+using OpenList = PriorityQueueOpenList<Node, NodeCompareOrdered>;
+#else
+using OpenList = DAryHeapOpenList<Node, OPEN_LIST_ARITY>;
+#endif
+
 // Cost function for PHS*, generalized LevinTS (if predicted_h = 0)
 double phs_cost(const Node *node, double predicted_h) {
     predicted_h = (predicted_h < 0) ? 0 : predicted_h;
     return std::log(predicted_h + node->g + 1e-8) - (node->p * (1.0 + (predicted_h / node->g)));
 }
 
-bool search(const SearchInput &input) {
-    using NodePointer = Node *;
-    int expanded = 0;
+using NodePointer = Node *;
+using Clock = std::chrono::steady_clock;
+
+double seconds_between(Clock::time_point start, Clock::time_point end) {
+    return std::chrono::duration<double>(end - start).count();
+}
+
+// Actions along the path from the root to the node
+std::vector<int> solution_path(const Node *node) {
+    std::vector<int> actions;
+    for (; node && node->parent; node = node->parent) {
+        actions.push_back(node->action);
+    }
+    std::reverse(actions.begin(), actions.end());
+    return actions;
+}
+
+// Nodes expanded by searches on the calling thread
+metrics::Counter &thread_expanded_metric() {
+    thread_local metrics::Counter &counter =
+        metrics::counter("search_nodes_expanded_total", "Nodes expanded, per thread", metrics::thread_label());
+    return counter;
+}
 
-    ModelEvaluator *model_eval = input.model_evaluator;
-    std::vector<Observation> inference_inputs{input.state.get_observation()};
-    InferenceOutput pred = model_eval->Inference(inference_inputs)[0];
+// Count a finished search in the metrics
+void record_finished(bool solved) {
+    static metrics::Counter &solved_counter =
+        metrics::counter("searches_finished_total", "Searches run to completion", "result=\"solved\"");
+    static metrics::Counter &failed_counter =
+        metrics::counter("searches_finished_total", "Searches run to completion", "result=\"failed\"");
+    (solved ? solved_counter : failed_counter).add();
+}
+
+// Count an inference request of the given number of states
+void record_request(SearchStats &stats, int num_states) {
+    ++stats.inference_requests;
+    stats.inferred_states += num_states;
+    stats.max_inference_batch = std::max(stats.max_inference_batch, num_states);
+}
+
+// Node and state memory of a search, which is reset and reused by the next search on the same thread
+struct SearchArena {
+    void reset() {
+        node_buffer.reset();
+        state_buffer.reset();
+    }
 
-    // Pre-allocate memory
-    StateContainer state_buffer(input.state);
+    StateContainer state_buffer;
     NodeBuffer node_buffer;
+};
+
+// Arenas of finished searches, kept per thread so that reuse needs no locking
+std::vector<std::unique_ptr<SearchArena>> &free_arenas() {
+    thread_local std::vector<std::unique_ptr<SearchArena>> arenas;
+    return arenas;
+}
+
+std::unique_ptr<SearchArena> acquire_arena() {
+    auto &arenas = free_arenas();
+    if (arenas.empty()) {
+        return std::make_unique<SearchArena>();
+    }
+    std::unique_ptr<SearchArena> arena = std::move(arenas.back());
+    arenas.pop_back();
+    return arena;
+}
+
+void release_arena(std::unique_ptr<SearchArena> arena) {
+    arena->reset();
+    free_arenas().push_back(std::move(arena));
+}
+
+// Scratch for stepping all children of a node at once, only used within a single expansion so shared by all
+// searches on the thread
+std::array<RNDGameState, kNumActions> &child_scratch() {
+    thread_local std::array<RNDGameState, kNumActions> children;
+    return children;
+}
+
+// Node and wall-clock budget of a search, the clock starts when the budget is created
+struct SearchBudget {
+    explicit SearchBudget(const SearchConfig &config)
+        : budget_nodes(config.budget_nodes),
+          has_deadline(config.time_limit.count() > 0),
+          deadline(Clock::now() + config.time_limit) {}
+
+    /**
+     * Check if the search has to stop before expanding another node.
+     * @param expanded Number of nodes expanded so far
+     * @return True if out of nodes or time
+     */
+    bool exhausted(int expanded) const {
+        return expanded >= budget_nodes || (has_deadline && Clock::now() >= deadline);
+    }
+
+    int budget_nodes;
+    bool has_deadline;
+    Clock::time_point deadline;
+};
+
+// Number of children to batch before sending an inference request.
+// When adaptive, the size doubles each time a request is sent while the evaluator has nothing queued, as the model is
+// then running batches smaller than it could, and halves back towards the configured size once requests back up.
+struct BatchThreshold {
+    explicit BatchThreshold(const SearchConfig &config)
+        : min_size(std::max(1, config.inference_batch_size)),
+          max_size(std::max(min_size, config.max_inference_batch_size)),
+          adaptive(config.adaptive_batching),
+          size(min_size) {}
+
+    // Adjust the size after sending a request, based on the backlog of the evaluator
+    void update(ModelEvaluator &model_eval) {
+        if (!adaptive) {
+            return;
+        }
+        if (model_eval.queued_requests() == 0) {
+            size = std::min(size * 2, max_size);
+        } else {
+            size = std::max(size / 2, min_size);
+        }
+    }
+
+    int min_size;
+    int max_size;
+    bool adaptive;
+    int size;
+};
+
+// Inputs for the next inference request, in whichever form the evaluator takes
+struct InferenceInputs {
+    explicit InferenceInputs(const SearchInput &input)
+        : compact(input.model_evaluator->compact_observations()),
+          observations(input.state.observation_size()),
+          cell_types(input.state.cell_types_size()) {}
+
+    void add(const RNDGameState &state) {
+        if (compact) {
+            state.write_cell_types(cell_types.append());
+        } else {
+            state.write_observation(observations.append());
+        }
+    }
+
+    // Move the batch into func, and start a new one
+    template <typename Func>
+    void take(Func &&func) {
+        if (compact) {
+            func(std::move(cell_types));
+            cell_types.clear();
+        } else {
+            func(std::move(observations));
+            observations.clear();
+        }
+    }
+
+    bool compact;                     // Flag to send cell types rather than full observations
+    ObservationBatch observations;    // Pending batch, when sending full observations
+    CellTypeBatch cell_types;         // Pending batch, when sending cell types
+};
+
+// Best-first bookkeeping of a search: open, the state table and the node memory.
+// Not thread safe, the parallel search guards it with a lock.
+struct SearchTree {
+    explicit SearchTree(const SearchInput &input)
+        : arena(acquire_arena()),
+          state_buffer(arena->state_buffer),
+          node_buffer(arena->node_buffer),
+          cache(input.model_evaluator->cache()),
+          policy_epsilon(input.config.policy_epsilon) {}
+
+    ~SearchTree() {
+        release_arena(std::move(arena));
+    }
+
+    SearchTree(const SearchTree &) = delete;
+    SearchTree &operator=(const SearchTree &) = delete;
+
+    // Set up the root once its prediction is available
+    void init_root(const RNDGameState &root_state, const InferenceOutput &pred) {
+        NodePointer root_node = node_buffer.get_node();
+        StateTable::Entry *entry = state_buffer.add_state(root_state).first;
+        root_node->set_values(nullptr, entry->state, 0, 0, -1);
+        root_node->action_log_policy = log_policy_noise(pred.policy, policy_epsilon);
+        entry->node = root_node;
+        entry->g = 0;
+        entry->status = StateTable::Status::kOpen;
+        open.push(root_node);
+        if (cache) {
+            cache->insert(entry->hash, pred);
+        }
+    }
 
-    RNDGameState root_state = input.state;
-    NodePointer root_node = node_buffer.get_node();
-    root_node->set_values(nullptr, &root_state, 0, 0, -1);
-    root_node->action_log_policy = log_policy_noise(pred.policy);
+    // Set the prediction of the node and add it to open, as the best path to its state
+    void push_predicted(NodePointer node, StateTable::Entry *entry, const Span<float> &policy, double heuristic) {
+        node->action_log_policy = log_policy_noise(policy, policy_epsilon);
+        node->levin_cost = phs_cost(node, heuristic);
+        node->h = heuristic;
+        entry->status = StateTable::Status::kOpen;
+        open.push(node);
+    }
 
-    state_buffer.add_state(root_state);
+    // Add the predicted children to open
+    // Children are only ever sent for inference once per state, so none can have been closed while waiting
+    void add_predicted_children(const std::vector<NodePointer> &nodes, const InferenceBatchOutput &predictions) {
+        assert((int)nodes.size() == predictions.size());
+        for (int i = 0; i < (int)predictions.size(); ++i) {
+            NodePointer child_node = nodes[i];
+            StateTable::Entry *entry = state_buffer.get_entry(*child_node->state);
+            assert(entry->status == StateTable::Status::kGenerated && entry->node == child_node);
+            const InferenceOutput pred = predictions[i];
+            if (cache) {
+                cache->insert(entry->hash, pred);
+            }
+            push_predicted(child_node, entry, pred.policy, pred.heuristic);
+        }
+    }
 
-    std::priority_queue<NodePointer, std::vector<NodePointer>, NodeCompareOrdered> open;
-    std::unordered_set<NodePointer, NodeHash, NodeCompareEqual> closed;
-    open.push(root_node);
+    /**
+     * Add the child reached from the node by the action, unless its state has already been reached as cheaply.
+     * Children are only batched for inference if their state is new and not in the cache. A cheaper path to a state
+     * which is already known reuses its prediction. The node is moved onto the cheaper path in place if it is still in
+     * open and the open list can update it, otherwise it is replaced by a new node (and reopened if closed).
+     * @param node Node being expanded
+     * @param child_state State after applying the action
+     * @param action_idx Index of the action in the legal actions of the node
+     * @param action The action
+     * @return The child node if it needs inference, nullptr otherwise
+     */
+    NodePointer add_child(NodePointer node, const RNDGameState &child_state, int action_idx, int action) {
+        const double child_g = node->g + 1;
+        const double child_p = node->p + node->action_log_policy[action_idx];
+        auto [entry, inserted] = state_buffer.add_state(child_state);
+        if (!inserted && child_g >= entry->g) {
+            return nullptr;
+        }
+        entry->g = child_g;
 
-    std::vector<NodePointer> children_to_predict;
-    std::vector<Observation> child_inference_inputs;
-    while (!open.empty()) {
-        NodePointer node = open.top();
-        open.pop();
-        closed.insert(node);
-        ++expanded;
+        // Prediction for the state is still pending, so the waiting node can simply take the cheaper path
+        if (!inserted && entry->status == StateTable::Status::kGenerated) {
+            // The state may be read without the lock by the parallel search, so is left untouched
+            entry->node->set_path(node, child_p, child_g, action);
+            return nullptr;
+        }
 
-        // Solution found
-        if (node->state->is_solution()) {
-            return true;
+        if constexpr (OpenList::kCanUpdate) {
+            if (!inserted && entry->status == StateTable::Status::kOpen) {
+                NodePointer open_node = entry->node;
+                open_node->set_path(node, child_p, child_g, action);
+                open_node->levin_cost = phs_cost(open_node, open_node->h);
+                open.update(open_node);
+                return nullptr;
+            }
         }
 
-        // Timeout
-        if (expanded >= BUDGET_NODES) {
-            break;
+        NodePointer child_node = node_buffer.get_node();
+        child_node->set_values(node, entry->state, child_p, child_g, action);
+        NodePointer previous_node = entry->node;
+        entry->node = child_node;
+
+        if (!inserted) {
+            child_node->action_log_policy = previous_node->action_log_policy;
+            child_node->levin_cost = phs_cost(child_node, previous_node->h);
+            child_node->h = previous_node->h;
+            entry->status = StateTable::Status::kOpen;
+            open.push(child_node);
+            return nullptr;
         }
+        if (cache && cache->lookup(entry->hash, cached_prediction)) {
+            const Span<float> policy(cached_prediction.policy.data(), cached_prediction.policy.size());
+            push_predicted(child_node, entry, policy, cached_prediction.heuristic);
+            return nullptr;
+        }
+        return child_node;
+    }
 
-        const std::vector<int> actions = node->state->legal_actions();
+    /**
+     * Add the children of an expanded node which are either solutions or not terminal.
+     * @param node Node being expanded
+     * @param children Result of each action on the state of the node, from expand_all()
+     * @param to_predict Children which need inference are added to this
+     */
+    void add_children(NodePointer node, const std::array<RNDGameState, kNumActions> &children,
+                      std::vector<NodePointer> &to_predict) {
+        const auto &actions = RNDGameState::kLegalActions;
+        static_assert(RNDGameState::kLegalActions.size() == kNumActions, "One policy entry per action");
+        for (int i = 0; i < (int)actions.size(); ++i) {
+            const RNDGameState &child_state = children[actions[i]];
+
+            // If terminal without being solved i.e. condition not met, then don't add for inference
+            if (child_state.is_terminal() && !child_state.is_solution()) {
+                continue;
+            }
 
-        // Consider all children
-        assert(actions.size() == node->action_log_policy.size());
-        for (int i = 0; i < (int)actions.size(); ++i) {    // Buffer empty, reallocate
-            RNDGameState child_state = *node->state;
-            child_state.apply_action(actions[i]);
+            NodePointer child_node = add_child(node, child_state, i, actions[i]);
+            if (child_node) {
+                to_predict.push_back(child_node);
+            }
+        }
+    }
 
-            // If terminal i.e. condition not met, then don't add for inference
-            if (child_state.is_terminal()) {
+    /**
+     * Take the best node from open and close it.
+     * @return The node, or nullptr if open is empty
+     */
+    NodePointer pop_best() {
+        while (!open.empty()) {
+            NodePointer node = open.top();
+            open.pop();
+
+            // A cheaper path to the state was found after this node was added, and replaced it in open
+            StateTable::Entry *entry = state_buffer.get_entry(*node->state);
+            if (entry->node != node) {
                 continue;
             }
+            entry->status = StateTable::Status::kClosed;
+            return node;
+        }
+        return nullptr;
+    }
+
+    std::unique_ptr<SearchArena> arena;
+    StateContainer &state_buffer;    // Views into the arena
+    NodeBuffer &node_buffer;
+    OpenList open;
+    InferenceCache *cache;                 // Shared prediction cache of the evaluator, if enabled
+    CachedPrediction cached_prediction;    // Scratch for cache lookups
+    double policy_epsilon;
+};
+
+struct PHSSearch::Impl {
+    Impl(const SearchInput &input, std::function<void()> on_ready)
+        : index(input.index),
+          model_eval(input.model_evaluator),
+          root_state(input.state),
+          tree(input),
+          inference_inputs(input),
+          budget(input.config),
+          batch_threshold(input.config),
+          on_ready(std::move(on_ready)) {}
+
+    // Queue inference for the pending batch, the result is picked up by the next step()
+    void submit_pending() {
+        inference_inputs.take([this](auto batch) { submit(std::move(batch)); });
+    }
+
+    // Queue inference for the batch, the result is picked up by the next step()
+    template <typename BatchT>
+    void submit(BatchT inputs) {
+        record_request(stats, inputs.size());
+        {
+            std::unique_lock<std::mutex> lock(m);
+            result_ready = false;
+            request_time = Clock::now();
+        }
+        // The notifier is copied so that nothing owned by the search is touched after the result is published,
+        // as the search may be destroyed as soon as it has been stepped
+        auto publish = [this, notify = on_ready](InferenceBatchOutput output, std::exception_ptr error) {
+            {
+                std::unique_lock<std::mutex> lock(m);
+                result = std::move(output);
+                result_error = error;
+                result_ready = true;
+                result_time = Clock::now();
+                cv.notify_all();
+            }
+            if (notify) {
+                notify();
+            }
+        };
+        model_eval->InferenceAsync(
+            std::move(inputs), [publish](InferenceBatchOutput output) { publish(std::move(output), nullptr); },
+            [publish](std::exception_ptr error) { publish({}, error); });
+    }
+
+    // Take the result of the outstanding request, blocking until it is available, rethrowing if it failed
+    InferenceBatchOutput take_result() {
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait(lock, [this]() { return result_ready; });
+        stats.inference_seconds += seconds_between(request_time, result_time);
+        if (result_error) {
+            std::rethrow_exception(result_error);
+        }
+        return std::move(result);
+    }
+
+    // Expand nodes until enough children are generated to batch inference, or the search ends
+    Status expand() {
+        std::array<RNDGameState, kNumActions> &children = child_scratch();
+        for (NodePointer node = tree.pop_best(); node; node = tree.pop_best()) {
+            ++stats.expanded;
+
+            // Solution found
+            if (node->state->is_solution()) {
+                solution_node = node;
+                return Status::kSolved;
+            }
+
+            // Timeout
+            if (budget.exhausted(stats.expanded)) {
+                break;
+            }
+
+            // Consider all children, stepped together
+            const std::size_t num_predicted = children_to_predict.size();
+            const Clock::time_point expand_start = Clock::now();
+            node->state->expand_all(children);
+            const Clock::time_point hash_start = Clock::now();
+            tree.add_children(node, children, children_to_predict);
+            stats.expand_seconds += seconds_between(expand_start, hash_start);
+            stats.hash_seconds += seconds_between(hash_start, Clock::now());
+            for (std::size_t i = num_predicted; i < children_to_predict.size(); ++i) {
+                inference_inputs.add(*children_to_predict[i]->state);
+            }
+
+            // Enough children saved to batch inference
+            if (((int)children_to_predict.size() >= batch_threshold.size || tree.open.empty()) &&
+                !children_to_predict.empty()) {
+                submit_pending();
+                batch_threshold.update(*model_eval);
+                return Status::kWaitingInference;
+            }
+        }
+        return Status::kFailed;
+    }
+
+    int index;
+    ModelEvaluator *model_eval;
+    RNDGameState root_state;
+    SearchTree tree;
+    std::vector<NodePointer> children_to_predict;    // Children in the pending batch, in order
+    InferenceInputs inference_inputs;
+    SearchBudget budget;
+    BatchThreshold batch_threshold;
+    bool root_pending = true;    // Flag if the outstanding request is for the root
+    Status status = Status::kWaitingInference;
+    SearchStats stats;
+    NodePointer solution_node = nullptr;
+
+    // Result of the outstanding inference request, set from the inference thread
+    std::function<void()> on_ready;
+    mutable std::mutex m;
+    mutable std::condition_variable cv;
+    bool result_ready = false;
+    InferenceBatchOutput result;
+    std::exception_ptr result_error;    // Set instead of the result if the evaluator couldn't answer
+    Clock::time_point request_time;
+    Clock::time_point result_time;
+};
+
+PHSSearch::PHSSearch(const SearchInput &input, std::function<void()> on_ready)
+    : impl_(std::make_unique<Impl>(input, std::move(on_ready))) {
+    impl_->inference_inputs.add(input.state);
+    impl_->submit_pending();
+}
+
+PHSSearch::~PHSSearch() = default;
+
+PHSSearch::Status PHSSearch::step() {
+    if (impl_->status != Status::kWaitingInference) {
+        return impl_->status;
+    }
+    InferenceBatchOutput predictions = impl_->take_result();
+    if (impl_->root_pending) {
+        impl_->tree.init_root(impl_->root_state, predictions[0]);
+        impl_->root_pending = false;
+    } else {
+        const Clock::time_point hash_start = Clock::now();
+        impl_->tree.add_predicted_children(impl_->children_to_predict, predictions);
+        impl_->stats.hash_seconds += seconds_between(hash_start, Clock::now());
+        impl_->children_to_predict.clear();
+    }
+    const int expanded_before = impl_->stats.expanded;
+    impl_->status = impl_->expand();
+    thread_expanded_metric().add(impl_->stats.expanded - expanded_before);
+    if (impl_->status != Status::kWaitingInference) {
+        record_finished(impl_->status == Status::kSolved);
+    }
+    return impl_->status;
+}
+
+bool PHSSearch::ready() const {
+    std::unique_lock<std::mutex> lock(impl_->m);
+    return impl_->status != Status::kWaitingInference || impl_->result_ready;
+}
+
+void PHSSearch::wait() const {
+    std::unique_lock<std::mutex> lock(impl_->m);
+    impl_->cv.wait(lock, [this]() { return impl_->status != Status::kWaitingInference || impl_->result_ready; });
+}
+
+PHSSearch::Status PHSSearch::status() const {
+    return impl_->status;
+}
+
+int PHSSearch::expanded() const {
+    return impl_->stats.expanded;
+}
+
+SearchResult PHSSearch::result() const {
+    SearchResult result;
+    result.index = impl_->index;
+    result.solved = impl_->status == Status::kSolved;
+    result.solution = solution_path(impl_->solution_node);
+    result.stats = impl_->stats;
+    result.stats.generated = impl_->tree.node_buffer.nodes.size();
+    return result;
+}
 
-            state_buffer.add_state(child_state);
-            NodePointer child_node = node_buffer.get_node();
-            child_node->set_values(node, state_buffer.get_state(child_state), node->p + node->action_log_policy[i],
-                                   node->g + 1, actions[i]);
+SearchResult search(const SearchInput &input) {
+    PHSSearch phs(input);
+    while (phs.status() == PHSSearch::Status::kWaitingInference) {
+        phs.wait();
+        phs.step();
+    }
+    return phs.result();
+}
 
-            // We will batch predict
-            children_to_predict.push_back(child_node);
-            child_inference_inputs.push_back(child_node->state->get_observation());
+// Single search shared by several threads. The tree is guarded by one lock, which each thread only releases while
+// stepping children or waiting on inference, as those are where the time goes.
+struct ParallelSearch {
+    explicit ParallelSearch(const SearchInput &input) : input(input), tree(input), budget(input.config) {}
+
+    // Pop up to parallel_expansions of the best nodes to expand, setting done once solved or out of budget
+    void take_best(std::vector<NodePointer> &expanding) {
+        expanding.clear();
+        while ((int)expanding.size() < input.config.parallel_expansions) {
+            NodePointer node = tree.pop_best();
+            if (!node) {
+                return;
+            }
+            ++expanded;
+            if (node->state->is_solution()) {
+                solution_node = node;
+                done = true;
+                return;
+            }
+            if (budget.exhausted(expanded)) {
+                done = true;
+                return;
+            }
+            expanding.push_back(node);
         }
+    }
 
-        // Enough children saved to batch inference
-        if ((int)children_to_predict.size() >= 32 || open.empty()) {
-            std::vector<InferenceOutput> predictions = model_eval->Inference(child_inference_inputs);
-            for (int i = 0; i < (int)predictions.size(); ++i) {
-                NodePointer child_node = children_to_predict[i];
-                if (closed.find(child_node) == closed.end()) {
-                    const InferenceOutput &pred = predictions[i];
-                    child_node->action_log_policy = log_policy_noise(pred.policy);
-                    child_node->levin_cost = phs_cost(child_node, pred.heuristic);
-                    child_node->h = pred.heuristic;
-                    open.push(child_node);
+    // Run by each thread until the search is solved, out of budget or exhausted, returning the stats of the thread
+    SearchStats run_thread() {
+        SearchStats stats;
+        InferenceInputs inference_inputs(input);
+        std::vector<NodePointer> expanding;
+        std::vector<NodePointer> to_predict;
+        std::array<RNDGameState, kNumActions> &children = child_scratch();
+
+        std::unique_lock<std::mutex> lock(m);
+        while (true) {
+            // Open can run dry while other threads wait on the inference which will refill it
+            cv.wait(lock, [this]() { return done || !tree.open.empty() || busy == 0; });
+            if (!done) {
+                const int expanded_before = expanded;
+                take_best(expanding);
+                thread_expanded_metric().add(expanded - expanded_before);
+                done = done || (expanding.empty() && tree.open.empty() && busy == 0);
+            }
+            if (done) {
+                cv.notify_all();
+                return stats;
+            }
+            if (expanding.empty()) {
+                continue;
+            }
+
+            ++busy;
+            for (NodePointer node : expanding) {
+                lock.unlock();
+                const Clock::time_point expand_start = Clock::now();
+                node->state->expand_all(children);
+                stats.expand_seconds += seconds_between(expand_start, Clock::now());
+                lock.lock();
+                const Clock::time_point hash_start = Clock::now();
+                tree.add_children(node, children, to_predict);
+                stats.hash_seconds += seconds_between(hash_start, Clock::now());
+            }
+            if (!to_predict.empty()) {
+                // States of queued children are never changed, so can be read without the lock
+                lock.unlock();
+                for (NodePointer node : to_predict) {
+                    inference_inputs.add(*node->state);
                 }
+                record_request(stats, to_predict.size());
+                const Clock::time_point inference_start = Clock::now();
+                InferenceBatchOutput predictions;
+                inference_inputs.take(
+                    [&](auto batch) { predictions = input.model_evaluator->Inference(std::move(batch)); });
+                stats.inference_seconds += seconds_between(inference_start, Clock::now());
+                lock.lock();
+                const Clock::time_point hash_start = Clock::now();
+                tree.add_predicted_children(to_predict, predictions);
+                stats.hash_seconds += seconds_between(hash_start, Clock::now());
+                to_predict.clear();
             }
-            children_to_predict.clear();
-            child_inference_inputs.clear();
+            --busy;
+            cv.notify_all();
         }
     }
 
-    return false;
+    const SearchInput &input;
+    SearchTree tree;
+    SearchBudget budget;
+    std::mutex m;
+    std::condition_variable cv;
+    int busy = 0;    // Threads expanding nodes or waiting on inference for their children
+    int expanded = 0;
+    bool done = false;
+    NodePointer solution_node = nullptr;
+};
+
+SearchResult parallel_search(const SearchInput &input, const SearchThreadRunner &run_threads) {
+    ParallelSearch search(input);
+    SearchResult result;
+    result.index = input.index;
+    InferenceInputs root_input(input);
+    root_input.add(input.state);
+    record_request(result.stats, 1);
+    const Clock::time_point inference_start = Clock::now();
+    root_input.take([&](auto batch) {
+        InferenceBatchOutput prediction = input.model_evaluator->Inference(std::move(batch));
+        result.stats.inference_seconds += seconds_between(inference_start, Clock::now());
+        search.tree.init_root(input.state, prediction[0]);
+    });
+    for (const SearchStats &thread_stats : run_threads([&search]() { return search.run_thread(); })) {
+        result.stats += thread_stats;
+    }
+    result.solved = search.solution_node != nullptr;
+    record_finished(result.solved);
+    result.solution = solution_path(search.solution_node);
+    result.stats.expanded = search.expanded;
+    result.stats.generated = search.tree.node_buffer.nodes.size();
+    return result;
 }
@@ -1,16 +1,172 @@
+// File: search.h
+// Description: PHS* search over RNDGameStates, guided by a ModelEvaluator
 
+#ifndef SEARCH_H_
+#define SEARCH_H_
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
 
 #include "model_evaluator.h"
 #include "rnd/stonesngems_base.h"
+#include "thread_pool.h"
 #include "types.h"
 
 using namespace stonesngems;
 
 
+// Runtime limits and tuning of a search
+struct SearchConfig {
+    int budget_nodes = 2000;                    // Max nodes expanded before giving up
+    std::chrono::milliseconds time_limit{0};    // Max wall-clock time from the start of the search, 0 for none
+    int inference_batch_size = 32;              // Children batched before sending an inference request
+    bool adaptive_batching = false;             // Grow the batch size while the evaluator has no backlog
+    int max_inference_batch_size = 256;         // Upper bound on the batch size when adaptive
+    int parallel_expansions = 8;                // Nodes each thread of a parallel search expands per request
+    int parallel_handoff_nodes = 0;             // Expansions after which the scheduler hands the search over to
+                                                // parallel_search at the end of the run, 0 to never
+    double policy_epsilon = 0;                  // Weight of uniform noise mixed into the policy
+};
+
 struct SearchInput {
     int index;
     RNDGameState state;
     ModelEvaluator *model_evaluator;
+    SearchConfig config = SearchConfig();
+};
+
+// Counts and per-phase wall times of one or more searches, small enough to return by value from the pool threads
+struct SearchStats {
+    int expanded = 0;                // Nodes taken from open and expanded
+    int generated = 0;               // Nodes created, on new states or cheaper paths to known ones
+    int inference_requests = 0;
+    int inferred_states = 0;         // States sent for inference, over all requests
+    int max_inference_batch = 0;     // Largest number of states in a single request
+    double expand_seconds = 0;       // Stepping the children of expanded nodes
+    double hash_seconds = 0;         // Looking the children up in the state table and adding them to open
+    double inference_seconds = 0;    // Waiting on inference, from sending a request until its result lands
+
+    SearchStats &operator+=(const SearchStats &other) {
+        expanded += other.expanded;
+        generated += other.generated;
+        inference_requests += other.inference_requests;
+        inferred_states += other.inferred_states;
+        max_inference_batch = std::max(max_inference_batch, other.max_inference_batch);
+        expand_seconds += other.expand_seconds;
+        hash_seconds += other.hash_seconds;
+        inference_seconds += other.inference_seconds;
+        return *this;
+    }
+
+    // Mean number of states per inference request
+    double mean_inference_batch() const {
+        return inference_requests > 0 ? (double)inferred_states / inference_requests : 0;
+    }
+};
+
+struct SearchResult {
+    int index = -1;               // Index of the search input
+    bool solved = false;
+    std::vector<int> solution;    // Actions from the input state to the solution, empty if not solved
+    SearchStats stats;
+};
+
+// Resumable PHS* search for a single input.
+// Rather than blocking on the model, step() returns as soon as it has queued an inference request, and the search can
+// be resumed once ready(). This lets a single thread interleave many searches while their batches are in flight.
+class PHSSearch {
+public:
+    enum class Status {
+        kWaitingInference,    // Inference request in flight, call step() once ready()
+        kSolved,              // Solution found
+        kFailed,              // Budget reached or search space exhausted
+    };
+
+    /**
+     * Create the search and queue the inference request for the root.
+     * @param input The search input, the model evaluator must outlive the search
+     * @param on_ready Called on the inference thread each time an outstanding request completes, so should be short
+     * and thread safe. The search is ready() by the time it is called.
+     */
+    explicit PHSSearch(const SearchInput &input, std::function<void()> on_ready = nullptr);
+    ~PHSSearch();
+
+    PHSSearch(const PHSSearch &) = delete;
+    PHSSearch &operator=(const PHSSearch &) = delete;
+
+    /**
+     * Consume the outstanding inference result and expand nodes until the next inference request is queued or the
+     * search finishes. Should only be called when ready(). Rethrows the error if the evaluator was destroyed before
+     * answering the outstanding request.
+     * @return Status of the search after stepping
+     */
+    Status step();
+
+    /**
+     * Check if the search can be stepped without blocking.
+     * @return True if there is no outstanding inference request or it has completed
+     */
+    bool ready() const;
+
+    // Block until ready()
+    void wait() const;
+
+    Status status() const;
+
+    // Number of nodes expanded so far
+    int expanded() const;
+
+    /**
+     * Result of the search so far, which is complete once the search is no longer waiting on inference.
+     * @return The result
+     */
+    SearchResult result() const;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
 };
 
-bool search(const SearchInput &input);
+/**
+ * Run a search to completion, blocking on each inference request.
+ * @param input The search input
+ * @return Result of the search
+ */
+SearchResult search(const SearchInput &input);
+
+// Runs the given search thread on each of a number of threads, blocking until all return, and gives back their stats
+using SearchThreadRunner = std::function<std::vector<SearchStats>(const std::function<SearchStats()> &)>;
+
+/**
+ * Run a single search to completion with several threads sharing its open list and transposition table.
+ * Each thread repeatedly takes the best few nodes from open, expands them and waits on inference for their children,
+ * so the search has up to num_threads requests in flight. Meant for hard inputs which would otherwise leave the
+ * rest of the pool idle, the order nodes are expanded in (and so the result) is not deterministic.
+ * @param input The search input
+ * @param run_threads Runs the search threads, see the overload taking a pool
+ * @return Result of the search, with the stats of all threads combined
+ */
+SearchResult parallel_search(const SearchInput &input, const SearchThreadRunner &run_threads);
+
+/**
+ * Run parallel_search on the threads of a pool of any job type, such as the pool of the scheduler, which only needs
+ * to be idle rather than set aside for it.
+ * @param input The search input
+ * @param pool Thread pool to run the search threads on, blocking it until done
+ * @param num_threads Number of threads to search with, at most the number of threads in the pool
+ * @return Result of the search, with the stats of all threads combined
+ */
+template <typename InputT>
+SearchResult parallel_search(const SearchInput &input, ThreadPool<InputT, SearchStats> &pool, int num_threads) {
+    assert(num_threads > 0);
+    return parallel_search(input, [&pool, num_threads](const std::function<SearchStats()> &search_thread) {
+        return pool.run([&search_thread](const InputT &) { return search_thread(); },
+                        std::vector<InputT>(num_threads));
+    });
+}
+
+#endif    // SEARCH_H_
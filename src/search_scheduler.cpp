@@ -0,0 +1,147 @@
+#include "search_scheduler.h"
+
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+#include "metrics.h"
+#include "trace.h"
+
+namespace {
+
+// Slots of searches whose inference results have landed, pushed from the inference threads
+class ReadyQueue {
+public:
+    // Notifies under the lock, as the worker may return and destroy the queue once it sees its last slot
+    void push(int slot) {
+        std::unique_lock<std::mutex> lock(m_);
+        ready_.push_back(slot);
+        cv_.notify_one();
+    }
+
+    // Block until at least one slot is ready, then take all that are
+    void wait_pop_all(std::vector<int> &slots) {
+        slots.clear();
+        std::unique_lock<std::mutex> lock(m_);
+        cv_.wait(lock, [this]() { return !ready_.empty(); });
+        slots.swap(ready_);
+    }
+
+private:
+    std::mutex m_;
+    std::condition_variable cv_;
+    std::vector<int> ready_;
+};
+
+// Run the handed off searches one after another on the now idle pool, and finish their jobs
+void run_handoffs(ThreadPool<SchedulerInput, SearchStats> &pool, int num_workers, SearchHandoffs &handoffs,
+                  SearchJobSource &jobs) {
+    for (SearchHandoffs::Job &handoff : handoffs.take()) {
+        TRACE_SCOPE("parallel_search");
+        SearchResult result = parallel_search(handoff.input, pool, num_workers);
+        result.stats += handoff.stats;
+        jobs.finish(handoff.job, std::move(result));
+    }
+}
+
+}    // namespace
+
+SearchStats run_search_worker(const SchedulerInput &input) {
+    assert(input.max_in_flight > 0);
+    SearchJobSource &jobs = *input.jobs;
+    ReadyQueue ready_queue;
+    std::vector<std::unique_ptr<PHSSearch>> searches(input.max_in_flight);
+    std::vector<int64_t> slot_jobs(input.max_in_flight, -1);
+    std::vector<std::optional<SearchInput>> slot_inputs(input.max_in_flight);    // Only kept if it may be handed off
+    std::optional<SearchInput> job_input;
+    int active = 0;
+    SearchStats stats;
+
+    // Start the next job in the slot, returns false if there are no jobs left
+    auto start_next = [&](int slot) {
+        const int64_t job = jobs.claim(job_input);
+        if (job < 0) {
+            return false;
+        }
+        slot_jobs[slot] = job;
+        searches[slot] = std::make_unique<PHSSearch>(*job_input, [&ready_queue, slot]() { ready_queue.push(slot); });
+        if (input.handoffs && job_input->config.parallel_handoff_nodes > 0) {
+            slot_inputs[slot] = std::move(job_input);
+        }
+        job_input.reset();
+        return true;
+    };
+
+    // Give the search up in favour of a parallel search, it has no request in flight once ready
+    auto hand_off = [&](int slot) {
+        SearchResult result = searches[slot]->result();
+        stats += result.stats;
+        input.handoffs->push({slot_jobs[slot], std::move(*slot_inputs[slot]), result.stats});
+        slot_inputs[slot].reset();
+    };
+
+    for (int slot = 0; slot < input.max_in_flight && start_next(slot); ++slot) {
+        ++active;
+    }
+
+    // Time the worker sleeps with all of its searches waiting on inference
+    thread_local metrics::Counter &idle_metric = metrics::counter(
+        "search_worker_idle_us_total", "Time workers wait on inference for all of their searches, in microseconds",
+        metrics::thread_label());
+
+    std::vector<int> ready_slots;
+    while (active > 0) {
+        const auto wait_start = std::chrono::steady_clock::now();
+        ready_queue.wait_pop_all(ready_slots);
+        idle_metric.add(metrics::micros_between(wait_start, std::chrono::steady_clock::now()));
+        for (int slot : ready_slots) {
+            if (slot_inputs[slot] && searches[slot]->expanded() >= slot_inputs[slot]->config.parallel_handoff_nodes) {
+                hand_off(slot);
+            } else {
+                TRACE_SCOPE("search_step");
+                PHSSearch::Status status = searches[slot]->step();
+                if (status == PHSSearch::Status::kWaitingInference) {
+                    continue;
+                }
+                SearchResult result = searches[slot]->result();
+                stats += result.stats;
+                jobs.finish(slot_jobs[slot], std::move(result));
+                slot_inputs[slot].reset();
+            }
+            searches[slot].reset();
+            if (!start_next(slot)) {
+                --active;
+            }
+        }
+    }
+    return stats;
+}
+
+std::vector<SearchResult> run_multiplexed_search(ThreadPool<SchedulerInput, SearchStats> &pool, int num_workers,
+                                                 const std::vector<SearchInput> &inputs, int max_in_flight,
+                                                 std::vector<SearchStats> *worker_stats) {
+    SearchJobs jobs(inputs);
+    SearchHandoffs handoffs;
+    std::vector<SearchStats> stats =
+        pool.run(run_search_worker, std::vector<SchedulerInput>(num_workers, {&jobs, max_in_flight, &handoffs}));
+    run_handoffs(pool, num_workers, handoffs, jobs);
+    if (worker_stats) {
+        *worker_stats = std::move(stats);
+    }
+    return jobs.take_results();
+}
+
+std::vector<SearchStats> run_streaming_search(ThreadPool<SchedulerInput, SearchStats> &pool, int num_workers,
+                                              SearchStream::Generator generator, SearchStream::Sink sink,
+                                              int max_in_flight) {
+    SearchStream stream(std::move(generator), std::move(sink));
+    SearchHandoffs handoffs;
+    std::vector<SearchStats> stats =
+        pool.run(run_search_worker, std::vector<SchedulerInput>(num_workers, {&stream, max_in_flight, &handoffs}));
+    run_handoffs(pool, num_workers, handoffs, stream);
+    return stats;
+}
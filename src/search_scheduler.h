@@ -0,0 +1,189 @@
+// File: search_scheduler.h
+// Description: Multiplexes many resumable searches on each thread of a thread pool
+
+#ifndef SEARCH_SCHEDULER_H_
+#define SEARCH_SCHEDULER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "search.h"
+#include "thread_pool.h"
+
+// Source of jobs shared by all scheduler workers, which claim the next job as they free up a slot.
+// Called concurrently from the workers, so implementations must be thread safe.
+class SearchJobSource {
+public:
+    virtual ~SearchJobSource() = default;
+
+    /**
+     * Claim the next unstarted job.
+     * @param input Set to the input of the job
+     * @return Id of the job, passed back to finish(), or -1 if there are none left
+     */
+    virtual int64_t claim(std::optional<SearchInput> &input) = 0;
+
+    /**
+     * Hand back the result of a claimed job.
+     * @param job Id of the job from claim()
+     * @param result Result of its search
+     */
+    virtual void finish(int64_t job, SearchResult result) = 0;
+};
+
+// Jobs for a vector of inputs, with the results collected in the same order
+class SearchJobs : public SearchJobSource {
+public:
+    /**
+     * @param inputs Search inputs, must outlive the jobs
+     */
+    explicit SearchJobs(const std::vector<SearchInput> &inputs) : inputs_(inputs), results_(inputs.size()) {}
+
+    int64_t claim(std::optional<SearchInput> &input) override {
+        int job = next_.fetch_add(1, std::memory_order_relaxed);
+        if (job >= (int)inputs_.size()) {
+            return -1;
+        }
+        input = inputs_[job];
+        return job;
+    }
+
+    // Jobs are only ever written by the worker which claimed them
+    void finish(int64_t job, SearchResult result) override {
+        results_[job] = std::move(result);
+    }
+
+    // Results in order of the inputs, only valid once all workers have finished
+    std::vector<SearchResult> take_results() {
+        return std::move(results_);
+    }
+
+private:
+    const std::vector<SearchInput> &inputs_;
+    std::atomic<int> next_{0};
+    std::vector<SearchResult> results_;
+};
+
+// Jobs pulled lazily from a generator, with each result passed to a sink as soon as its search finishes.
+// Only the inputs of running searches are held, so memory use doesn't depend on the number of jobs.
+class SearchStream : public SearchJobSource {
+public:
+    using Generator = std::function<std::optional<SearchInput>()>;
+    using Sink = std::function<void(SearchResult)>;
+
+    /**
+     * @param generator Called for each next input until it returns nullopt, never concurrently
+     * @param sink Called with each result in the order searches finish, never concurrently. It runs on the worker
+     * which ran the search, so a slow sink holds back that worker's searches rather than buffering results.
+     */
+    SearchStream(Generator generator, Sink sink) : generator_(std::move(generator)), sink_(std::move(sink)) {}
+
+    int64_t claim(std::optional<SearchInput> &input) override {
+        std::unique_lock<std::mutex> lock(generator_m_);
+        if (exhausted_) {
+            return -1;
+        }
+        input = generator_();
+        if (!input) {
+            exhausted_ = true;
+            return -1;
+        }
+        return next_job_++;
+    }
+
+    // Separately locked from claim(), so loading inputs and writing results overlap
+    void finish(int64_t, SearchResult result) override {
+        std::unique_lock<std::mutex> lock(sink_m_);
+        sink_(std::move(result));
+    }
+
+private:
+    Generator generator_;
+    Sink sink_;
+    std::mutex generator_m_;
+    std::mutex sink_m_;
+    int64_t next_job_ = 0;
+    bool exhausted_ = false;
+};
+
+// Jobs given up by the workers once past their parallel_handoff_nodes, to be run again with parallel_search once the
+// workers are done. Pushed to concurrently from the workers.
+class SearchHandoffs {
+public:
+    struct Job {
+        int64_t job;          // Id of the job from its source
+        SearchInput input;
+        SearchStats stats;    // Stats of the search given up, added to those of the parallel search
+    };
+
+    void push(Job job) {
+        std::unique_lock<std::mutex> lock(m_);
+        jobs_.push_back(std::move(job));
+    }
+
+    std::vector<Job> take() {
+        std::unique_lock<std::mutex> lock(m_);
+        return std::move(jobs_);
+    }
+
+private:
+    std::mutex m_;
+    std::vector<Job> jobs_;
+};
+
+// Input for a single scheduler worker
+struct SchedulerInput {
+    SearchJobSource *jobs;
+    int max_in_flight;                     // Maximum searches the worker keeps suspended on inference at once
+    SearchHandoffs *handoffs = nullptr;    // Takes searches past their parallel_handoff_nodes, null to never hand off
+};
+
+/**
+ * Run searches from the shared jobs on the calling thread until none are left.
+ * Up to max_in_flight searches are kept alive, each suspended while its inference request is in flight, and are
+ * resumed in the order their results land. The thread sleeps only when every one of its searches is waiting.
+ * A search which has expanded its config's parallel_handoff_nodes is given up rather than resumed, and passed to
+ * the handoffs instead of finished.
+ * @param input The shared jobs and the worker limits
+ * @return Combined stats of the searches run by this worker, including those handed off
+ */
+SearchStats run_search_worker(const SchedulerInput &input);
+
+/**
+ * Run all searches, multiplexing up to max_in_flight searches on each thread of the pool.
+ * Searches handed off (see SearchConfig::parallel_handoff_nodes) are then restarted one at a time with
+ * parallel_search on num_workers threads of the same pool, so the hardest inputs get every thread at the tail.
+ * The model evaluators should be created with enough queue depth for pool threads * max_in_flight requests.
+ * @param pool Thread pool to run the workers on
+ * @param num_workers Number of workers to start, usually the number of threads in the pool
+ * @param inputs The search inputs
+ * @param max_in_flight Maximum number of concurrent searches per worker
+ * @param worker_stats If given, set to the combined stats of the searches run by each worker
+ * @return Result of each search, in order of the inputs
+ */
+std::vector<SearchResult> run_multiplexed_search(ThreadPool<SchedulerInput, SearchStats> &pool, int num_workers,
+                                                 const std::vector<SearchInput> &inputs, int max_in_flight,
+                                                 std::vector<SearchStats> *worker_stats = nullptr);
+
+/**
+ * Run searches from a generator until it runs dry, multiplexing up to max_in_flight searches on each thread of the
+ * pool and passing each result to the sink as it finishes. At most num_workers * max_in_flight inputs are held at once,
+ * plus those of searches handed off, which are run with parallel_search once the generator is done as for
+ * run_multiplexed_search.
+ * @param pool Thread pool to run the workers on
+ * @param num_workers Number of workers to start, usually the number of threads in the pool
+ * @param generator Called for each next input until it returns nullopt, see SearchStream
+ * @param sink Called with each result as its search finishes, see SearchStream
+ * @param max_in_flight Maximum number of concurrent searches per worker
+ * @return Combined stats of the searches run by each worker
+ */
+std::vector<SearchStats> run_streaming_search(ThreadPool<SchedulerInput, SearchStats> &pool, int num_workers,
+                                              SearchStream::Generator generator, SearchStream::Sink sink,
+                                              int max_in_flight);
+
+#endif    // SEARCH_SCHEDULER_H_
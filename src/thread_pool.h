@@ -1,20 +1,24 @@
 // File: thread_pool.h
-// Description: Simple thread pool class to dispatch threads continuously on input
+// Description: Persistent work stealing thread pool to dispatch threads continuously on input
 
 #ifndef THREAD_POOL_H_
 #define THREAD_POOL_H_
 
-#include <functional>
-#include <limits>
-#include <map>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
 #include <mutex>
 #include <thread>
+#include <type_traits>
 #include <vector>
 
-#include "queue.h"
-
 
 // Create a thread pool object.
+// Threads are started once on construction and are reused by every call to run. Each thread has its own job deque
+// which it takes from the front of, and steals from the back of the others once it runs dry.
 template <typename InputT, typename OutputT>
 class ThreadPool {
 public:
@@ -24,92 +28,160 @@ public:
      * Create a thread pool object.
      * @param num_threads Number of threads the pool should run
      */
-    ThreadPool(int num_threads)
-        : num_threads(num_threads),
-          queue_input_(std::numeric_limits<uint16_t>::max()),
-          queue_output_(std::numeric_limits<uint16_t>::max()) {}
+    ThreadPool(int num_threads) : num_threads(num_threads), workers_(new Worker[num_threads]) {
+        assert(num_threads > 0);
+        threads_.reserve(num_threads);
+        for (int i = 0; i < num_threads; ++i) {
+            threads_.emplace_back([this, i]() { this->thread_runner(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::unique_lock<std::mutex> lock(m_);
+            stop_ = true;
+            work_cv_.notify_all();
+        }
+        for (auto& t : threads_) {
+            t.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
 
     /**
-     * Run the given function on the thread pool.
-     * @param func Function to run in parallel, which should match templated arguments for input and output
+     * Run the given function on the thread pool, blocking until all jobs are complete.
+     * Calls from multiple threads are run one after another.
+     * @param func Function to run in parallel, callable with a const InputT& and returning something assignable to
+     * OutputT. It is called concurrently from the pool threads.
      * @param inputs Input items for each job, gets passed to the given function
-     * @return Vector of results, in order of given jobs during construction
+     * @return Vector of results, in order of given jobs
      */
-    std::vector<OutputT> run(std::function<OutputT(InputT)> func, const std::vector<InputT>& inputs) {
-        // Populate queue
-        int id = -1;
-        for (auto const& job : inputs) {
-            queue_input_.Push({job, ++id});
+    template <typename Func>
+    std::vector<OutputT> run(Func&& func, const std::vector<InputT>& inputs) {
+        static_assert(std::is_default_constructible_v<OutputT>, "Results are written in place, OutputT needs a default");
+        std::unique_lock<std::mutex> run_lock(run_m_);
+        const int num_jobs = (int)inputs.size();
+        if (num_jobs == 0) {
+            return {};
         }
 
-        // Start N threads
-        threads_.reserve(num_threads);
-        for (int i = 0; i < num_threads; ++i) {
-            threads_.emplace_back([this, func]() { this->thread_runner(func); });
+        // Not a std::vector, as vector<bool> would have threads writing neighbouring results to the same word
+        std::unique_ptr<OutputT[]> outputs(new OutputT[num_jobs]);
+        using FuncT = std::remove_reference_t<Func>;
+        BatchContext<FuncT> context{&func, &inputs, outputs.get()};
+        {
+            std::unique_lock<std::mutex> lock(m_);
+            batch_ = {&run_job<FuncT>, &context};
+            remaining_.store(num_jobs, std::memory_order_relaxed);
         }
 
-        // Wait for all to complete
-        for (auto& t : threads_) {
-            t.join();
-        }
-        threads_.clear();
-
-        // Compile results, such that the id is in order to match passed order
-        std::vector<OutputT> results;
-        results.reserve(queue_output_.Size());
-        std::map<int, OutputT> result_map;
-        while (!queue_output_.Empty()) {
-            std::optional<QueueItemOutput> result = queue_output_.Pop();
-            result_map.emplace(result->id, result->output);
+        // Each worker starts on a contiguous block of the jobs
+        for (int i = 0; i < num_threads; ++i) {
+            std::unique_lock<std::mutex> lock(workers_[i].m);
+            for (int job = (int64_t)num_jobs * i / num_threads; job < (int64_t)num_jobs * (i + 1) / num_threads; ++job) {
+                workers_[i].jobs.push_back(job);
+            }
         }
-        for (auto const& result : result_map) {
-            results.push_back(result.second);
+
+        // Wake the workers and wait for all to complete
+        {
+            std::unique_lock<std::mutex> lock(m_);
+            ++generation_;
+            work_cv_.notify_all();
+            done_cv_.wait(lock, [this]() { return remaining_.load(std::memory_order_acquire) == 0; });
         }
 
-        return results;
+        return std::vector<OutputT>(std::make_move_iterator(outputs.get()),
+                                    std::make_move_iterator(outputs.get() + num_jobs));
     }
 
 private:
-    struct QueueItemInput {    // Wrapper for input type with id
-        InputT input;
-        int id;
+    // Type erased handle to the batch being run, so the workers need no std::function
+    struct Batch {
+        void (*run_job)(void* context, int job);
+        void* context;
+    };
+
+    template <typename FuncT>
+    struct BatchContext {
+        FuncT* func;
+        const std::vector<InputT>* inputs;
+        OutputT* outputs;
     };
 
-    struct QueueItemOutput {    // Wrapper for output type with id
-        OutputT output;
-        int id;
+    template <typename FuncT>
+    static void run_job(void* context, int job) {
+        BatchContext<FuncT>* batch = static_cast<BatchContext<FuncT>*>(context);
+        batch->outputs[job] = (*batch->func)((*batch->inputs)[job]);
+    }
+
+    // Job indices owned by a single worker, padded so that neighbouring locks don't share a cache line
+    struct alignas(64) Worker {
+        std::mutex m;
+        std::deque<int> jobs;
     };
 
-    // Runner for each thread, runs given function and pulls next item from input jobs if available
-    void thread_runner(std::function<OutputT(InputT)> func) {
+    // Next job for the worker, from its own deque or stolen from another, or -1 if there are none left
+    int next_job(int id) {
+        {
+            Worker& self = workers_[id];
+            std::unique_lock<std::mutex> lock(self.m);
+            if (!self.jobs.empty()) {
+                int job = self.jobs.front();
+                self.jobs.pop_front();
+                return job;
+            }
+        }
+        for (int i = 1; i < num_threads; ++i) {
+            Worker& victim = workers_[(id + i) % num_threads];
+            std::unique_lock<std::mutex> lock(victim.m);
+            if (!victim.jobs.empty()) {
+                int job = victim.jobs.back();
+                victim.jobs.pop_back();
+                return job;
+            }
+        }
+        return -1;
+    }
+
+    // Runner for each thread, sleeps until a batch is started then runs jobs until there are none left to take
+    void thread_runner(int id) {
+        uint64_t seen_generation = 0;
         while (true) {
-            std::optional<QueueItemInput> item;
             {
-                std::unique_lock<std::mutex> lock(queue_input_m_);
-                // Jobs are done, thread can stop
-                if (queue_input_.Empty()) {
-                    break;
+                std::unique_lock<std::mutex> lock(m_);
+                work_cv_.wait(lock, [&]() { return stop_ || generation_ != seen_generation; });
+                if (stop_) {
+                    return;
                 }
-                item = queue_input_.Pop();
+                seen_generation = generation_;
             }
 
-            // Run job
-            OutputT result = func(item->input);
-
-            // Store result
-            {
-                std::unique_lock<std::mutex> lock(queue_output_m_);
-                queue_output_.Push({result, item->id});
+            for (int job = next_job(id); job >= 0; job = next_job(id)) {
+                // The batch is published before its jobs are pushed, so it is current for any job taken
+                Batch batch = batch_;
+                batch.run_job(batch.context, job);
+                if (remaining_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    std::unique_lock<std::mutex> lock(m_);
+                    done_cv_.notify_all();
+                }
             }
         }
     }
 
-    int num_threads;                                 // How many threads in the pool
-    std::vector<std::thread> threads_;               // Threads in the pool
-    ThreadedQueue<QueueItemInput> queue_input_;      // Queue for input argument for job
-    ThreadedQueue<QueueItemOutput> queue_output_;    // Queue for output return values for job
-    std::mutex queue_input_m_;                       // Mutex for the input queue
-    std::mutex queue_output_m_;                      // Musted for the output queue
+    int num_threads;                       // How many threads in the pool
+    std::vector<std::thread> threads_;     // Threads in the pool
+    std::unique_ptr<Worker[]> workers_;    // Job deque for each thread
+    std::mutex run_m_;                     // Serializes calls to run
+    std::mutex m_;                         // Guards the fields below, other than the atomic count
+    std::condition_variable work_cv_;      // Signals workers that a batch started or the pool is stopping
+    std::condition_variable done_cv_;      // Signals run that the last job finished
+    Batch batch_{nullptr, nullptr};        // Batch currently being run
+    uint64_t generation_ = 0;              // Incremented for each batch
+    bool stop_ = false;
+    std::atomic<int> remaining_{0};        // Jobs of the current batch not yet finished
 };
 
-#endif    // THREAD_POOL_H_
\ No newline at end of file
+#endif    // THREAD_POOL_H_
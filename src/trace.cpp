@@ -0,0 +1,112 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace trace {
+
+namespace internal {
+std::atomic<bool> enabled_flag{false};
+}    // namespace internal
+
+namespace {
+
+constexpr std::size_t kBufferCapacity = 1 << 16;    // Events kept per thread, oldest are overwritten
+
+struct Event {
+    const char *name;
+    uint64_t start_ns;
+    uint64_t end_ns;
+};
+
+// Ring buffer owned by a single writing thread
+struct ThreadBuffer {
+    explicit ThreadBuffer(int tid) : tid(tid), events(kBufferCapacity) {}
+    int tid;
+    std::atomic<uint64_t> head{0};    // Total number of events written
+    std::vector<Event> events;
+};
+
+// Buffers outlive their threads so that events from finished threads can still be exported
+struct Registry {
+    std::mutex m;
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+};
+
+Registry &registry() {
+    static Registry instance;
+    return instance;
+}
+
+ThreadBuffer &thread_buffer() {
+    thread_local ThreadBuffer *buffer = nullptr;
+    if (!buffer) {
+        Registry &reg = registry();
+        std::unique_lock<std::mutex> lock(reg.m);
+        reg.buffers.push_back(std::make_unique<ThreadBuffer>((int)reg.buffers.size()));
+        buffer = reg.buffers.back().get();
+    }
+    return *buffer;
+}
+
+}    // namespace
+
+void set_enabled(bool enabled) {
+    internal::enabled_flag.store(enabled, std::memory_order_relaxed);
+}
+
+void record(const char *name, uint64_t start_ns, uint64_t end_ns) {
+    ThreadBuffer &buffer = thread_buffer();
+    uint64_t head = buffer.head.load(std::memory_order_relaxed);
+    buffer.events[head % kBufferCapacity] = {name, start_ns, end_ns};
+    buffer.head.store(head + 1, std::memory_order_release);
+}
+
+bool write_chrome_trace(const std::string &path) {
+    std::ofstream out(path);
+    if (!out) {
+        return false;
+    }
+    Registry &reg = registry();
+    std::unique_lock<std::mutex> lock(reg.m);
+
+    // Timestamps are made relative to the earliest event so they stay readable
+    uint64_t origin_ns = UINT64_MAX;
+    for (const auto &buffer : reg.buffers) {
+        uint64_t head = buffer->head.load(std::memory_order_acquire);
+        uint64_t first = head > kBufferCapacity ? head - kBufferCapacity : 0;
+        for (uint64_t i = first; i < head; ++i) {
+            origin_ns = std::min(origin_ns, buffer->events[i % kBufferCapacity].start_ns);
+        }
+    }
+
+    out << "{\"traceEvents\":[";
+    bool first_event = true;
+    for (const auto &buffer : reg.buffers) {
+        uint64_t head = buffer->head.load(std::memory_order_acquire);
+        uint64_t first = head > kBufferCapacity ? head - kBufferCapacity : 0;
+        for (uint64_t i = first; i < head; ++i) {
+            const Event &event = buffer->events[i % kBufferCapacity];
+            out << (first_event ? "" : ",") << "\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":0,\"tid\":"
+                << buffer->tid << ",\"ts\":" << (event.start_ns - origin_ns) / 1000.0
+                << ",\"dur\":" << (event.end_ns - event.start_ns) / 1000.0 << "}";
+            first_event = false;
+        }
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    return (bool)out;
+}
+
+void clear() {
+    Registry &reg = registry();
+    std::unique_lock<std::mutex> lock(reg.m);
+    for (auto &buffer : reg.buffers) {
+        buffer->head.store(0, std::memory_order_release);
+    }
+}
+
+}    // namespace trace
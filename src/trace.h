@@ -0,0 +1,84 @@
+// File: trace.h
+// Description: Low overhead per-thread event tracing, exportable as a Chrome trace (chrome://tracing, Perfetto)
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Tracing is compiled out unless ENABLE_TRACING is defined, and when compiled in is off until enabled at runtime.
+// Each thread records into its own fixed size ring buffer, so recording an event never takes a lock.
+namespace trace {
+
+namespace internal {
+extern std::atomic<bool> enabled_flag;
+}    // namespace internal
+
+// Current time in nanoseconds on the clock used for all trace events
+inline uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+/**
+ * Turn recording on or off at runtime.
+ * @param enabled Flag to record events
+ */
+void set_enabled(bool enabled);
+
+inline bool enabled() {
+    return internal::enabled_flag.load(std::memory_order_relaxed);
+}
+
+/**
+ * Record a complete event on the calling thread.
+ * @param name Event name, must outlive the trace (string literals)
+ * @param start_ns Start time from now_ns()
+ * @param end_ns End time from now_ns()
+ */
+void record(const char *name, uint64_t start_ns, uint64_t end_ns);
+
+/**
+ * Write all events recorded so far as Chrome trace JSON.
+ * Should be called once the traced threads are idle, as slots still being written may otherwise be read.
+ * @param path File to write to
+ * @return True if the file was written, false otherwise
+ */
+bool write_chrome_trace(const std::string &path);
+
+// Drop all recorded events
+void clear();
+
+// Records an event covering the lifetime of the object
+class ScopedEvent {
+public:
+    explicit ScopedEvent(const char *name) : name_(name), start_ns_(enabled() ? now_ns() : 0) {}
+    ~ScopedEvent() {
+        if (start_ns_ > 0) {
+            record(name_, start_ns_, now_ns());
+        }
+    }
+    ScopedEvent(const ScopedEvent &) = delete;
+    ScopedEvent &operator=(const ScopedEvent &) = delete;
+
+private:
+    const char *name_;
+    uint64_t start_ns_;
+};
+
+}    // namespace trace
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b)       TRACE_CONCAT_INNER(a, b)
+
+#ifdef ENABLE_TRACING
+#define TRACE_SCOPE(name) trace::ScopedEvent TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#else
+#define TRACE_SCOPE(name)
+#endif
+
+#endif    // TRACE_H_
@@ -0,0 +1,134 @@
+// File: transposition_table.h
+// Description: Open addressing table of states seen during a search, keyed by their Zobrist hash
+
+#ifndef TRANSPOSITION_TABLE_H_
+#define TRANSPOSITION_TABLE_H_
+
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+// Linear probing table holding a pointer to the stored copy of each state along with its search bookkeeping.
+// NodeT is the search's node type, the table only stores pointers to them.
+// Slots are matched on the 64-bit hash alone, with the full state only compared when the hashes match (and only
+// if verify is set), so a probe normally touches a single cache line.
+// Entries are stamped with a generation, so clear() is O(1) and the slots are reused by the next search.
+template <typename StateT, typename NodeT>
+class TranspositionTable {
+public:
+    enum class Status : uint8_t {
+        kGenerated,    // Seen as a child, not yet put in open
+        kOpen,         // In open, waiting to be expanded
+        kClosed,       // Expanded
+    };
+
+    struct Entry {
+        uint64_t hash;
+        const StateT *state;    // Stored copy of the state, set by the caller on insert
+        NodeT *node;            // Node holding the best path to the state
+        double g;               // Best path cost the state has been reached with
+        uint32_t generation;    // Entry is only in use if this matches the table generation
+        Status status;
+    };
+
+    /**
+     * @param capacity Initial number of slots, rounded up to a power of two
+     * @param verify Flag to compare full states on hash matches, rather than trusting the hash
+     */
+    explicit TranspositionTable(int capacity = 1024, bool verify = true) : verify_(verify) {
+        std::size_t slots = 2;
+        while (slots < (std::size_t)capacity) {
+            slots <<= 1;
+        }
+        entries_.resize(slots, Entry{0, nullptr, nullptr, 0, 0, Status::kGenerated});
+    }
+
+    /**
+     * Find the entry for the state, adding one if not present.
+     * A new entry has its status set to kGenerated, g to infinity and no node. Its state pointer is left null, and
+     * the caller has to set it to a copy that outlives the entry before the next call.
+     * @param hash Hash of the state
+     * @param state State to find
+     * @return The entry, which is only valid until the next insert, and true if it was added
+     */
+    std::pair<Entry *, bool> insert(uint64_t hash, const StateT &state) {
+        if ((size_ + 1) * 2 > entries_.size()) {
+            grow();
+        }
+        Entry *entry = probe(hash, state);
+        if (entry->generation == generation_) {
+            return {entry, false};
+        }
+        *entry = Entry{hash, nullptr, nullptr, std::numeric_limits<double>::infinity(), generation_, Status::kGenerated};
+        ++size_;
+        return {entry, true};
+    }
+
+    /**
+     * Find the entry for the state.
+     * @param hash Hash of the state
+     * @param state State to find
+     * @return The entry, which is only valid until the next insert, or nullptr if not present
+     */
+    Entry *find(uint64_t hash, const StateT &state) {
+        Entry *entry = probe(hash, state);
+        return entry->generation == generation_ ? entry : nullptr;
+    }
+
+    // Remove all entries, keeping the slots for reuse
+    void clear() {
+        size_ = 0;
+        if (++generation_ == 0) {
+            // Wrapped around, so stale stamps could look current
+            for (auto &entry : entries_) {
+                entry.generation = 0;
+            }
+            generation_ = 1;
+        }
+    }
+
+    int size() const {
+        return (int)size_;
+    }
+
+private:
+    // Slot holding the state, or the empty slot it would go in
+    Entry *probe(uint64_t hash, const StateT &state) {
+        const std::size_t mask = entries_.size() - 1;
+        for (std::size_t i = hash & mask;; i = (i + 1) & mask) {
+            Entry &entry = entries_[i];
+            if (entry.generation != generation_) {
+                return &entry;
+            }
+            if (entry.hash == hash && (!verify_ || *entry.state == state)) {
+                return &entry;
+            }
+        }
+    }
+
+    // Double the number of slots, reinserting all current entries
+    void grow() {
+        std::vector<Entry> old_entries(entries_.size() * 2, Entry{0, nullptr, nullptr, 0, 0, Status::kGenerated});
+        old_entries.swap(entries_);
+        const std::size_t mask = entries_.size() - 1;
+        for (const auto &old_entry : old_entries) {
+            if (old_entry.generation != generation_) {
+                continue;
+            }
+            std::size_t i = old_entry.hash & mask;
+            while (entries_[i].generation == generation_) {
+                i = (i + 1) & mask;
+            }
+            entries_[i] = old_entry;
+        }
+    }
+
+    bool verify_;
+    std::vector<Entry> entries_;
+    std::size_t size_ = 0;
+    uint32_t generation_ = 1;    // Slots start at generation 0, so are all empty
+};
+
+#endif    // TRANSPOSITION_TABLE_H_
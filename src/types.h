@@ -5,6 +5,9 @@
 #define TYPES_H_
 
 #include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <memory>
 #include <vector>
 
 // Observation struct for parameterizing model input
@@ -15,11 +18,164 @@ struct ObservationShape {
     int w;
 };
 
+// Non-owning view over a contiguous range of values
+template <typename T>
+class Span {
+public:
+    Span() = default;
+    Span(const T *data, std::size_t size) : data_(data), size_(size) {}
+
+    const T *data() const {
+        return data_;
+    }
+    std::size_t size() const {
+        return size_;
+    }
+    bool empty() const {
+        return size_ == 0;
+    }
+    const T *begin() const {
+        return data_;
+    }
+    const T *end() const {
+        return data_ + size_;
+    }
+    const T &operator[](std::size_t i) const {
+        assert(i < size_);
+        return data_[i];
+    }
+
+private:
+    const T *data_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+// Fixed size rows packed back to back, so a batch can be written in place and copied in one go
+template <typename T>
+class PackedBatch {
+public:
+    PackedBatch() = default;
+    /**
+     * @param row_size Number of values in each row
+     * @param capacity Number of rows to reserve space for
+     */
+    explicit PackedBatch(int row_size, int capacity = 0) : row_size_(row_size) {
+        data_.reserve((std::size_t)row_size * capacity);
+    }
+
+    int row_size() const {
+        return row_size_;
+    }
+    int size() const {
+        return row_size_ == 0 ? 0 : (int)(data_.size() / row_size_);
+    }
+    bool empty() const {
+        return data_.empty();
+    }
+    const T *data() const {
+        return data_.data();
+    }
+    const T *operator[](int i) const {
+        assert(i < size());
+        return data_.data() + (std::size_t)i * row_size_;
+    }
+
+    /**
+     * Add a zeroed row to the end of the batch.
+     * @return Pointer to write the row into, valid until the batch is next added to
+     */
+    T *append() {
+        data_.resize(data_.size() + row_size_, T(0));
+        return data_.data() + data_.size() - row_size_;
+    }
+
+    // Add a copy of all rows of another batch with the same row size
+    void append(const PackedBatch &other) {
+        assert(other.empty() || other.row_size_ == row_size_);
+        data_.insert(data_.end(), other.data_.begin(), other.data_.end());
+    }
+
+    void push_back(const std::vector<T> &row) {
+        assert((int)row.size() == row_size_);
+        data_.insert(data_.end(), row.begin(), row.end());
+    }
+
+    void clear() {
+        data_.clear();
+    }
+
+    // Clear the batch and change the row size, keeping the allocation
+    void reset(int row_size) {
+        data_.clear();
+        row_size_ = row_size;
+    }
+
+private:
+    int row_size_ = 0;
+    std::vector<T> data_;
+};
+
+// Flat observations for a batch
+using ObservationBatch = PackedBatch<float>;
+
+// Visible cell type of each board cell for a batch, expanded to one-hot observations on the model's device
+using CellTypeBatch = PackedBatch<int8_t>;
+
+// Model prediction for a single observation
+// Views into the buffer of the InferenceBatchOutput it came from, and is only valid while that is alive
 struct InferenceOutput {
-    std::vector<double> logits;
-    std::vector<double> policy;
-    std::vector<double> log_policy;
-    double heuristic;
+    Span<float> logits;    // Empty unless the model was asked to output logits
+    Span<float> policy;
+    Span<float> log_policy;
+    float heuristic;
+};
+
+// Model predictions for a batch of observations, packed into one contiguous buffer.
+// Each row is laid out as [policy, log_policy, heuristic, logits (optional)].
+class InferenceBatchOutput {
+public:
+    InferenceBatchOutput() = default;
+    InferenceBatchOutput(std::shared_ptr<const float> buffer, int batch_size, int num_actions, bool has_logits)
+        : buffer_(std::move(buffer)),
+          offset_(0),
+          size_(batch_size),
+          num_actions_(num_actions),
+          has_logits_(has_logits),
+          stride_(row_stride(num_actions, has_logits)) {}
+
+    // Number of floats each observation takes up in the packed buffer
+    static int row_stride(int num_actions, bool has_logits) {
+        return 2 * num_actions + 1 + (has_logits ? num_actions : 0);
+    }
+
+    int size() const {
+        return size_;
+    }
+
+    InferenceOutput operator[](int i) const {
+        assert(i >= 0 && i < size_);
+        const float *row = buffer_.get() + (std::size_t)(offset_ + i) * stride_;
+        const std::size_t a = num_actions_;
+        return {has_logits_ ? Span<float>(row + 2 * a + 1, a) : Span<float>(), Span<float>(row, a),
+                Span<float>(row + a, a), row[2 * a]};
+    }
+
+    // Sub-range of the batch, sharing ownership of the same buffer
+    InferenceBatchOutput slice(int offset, int size) const {
+        assert(offset >= 0 && offset + size <= size_);
+        InferenceBatchOutput output = *this;
+        output.offset_ += offset;
+        output.size_ = size;
+        return output;
+    }
+
+private:
+    std::shared_ptr<const float> buffer_;
+    int offset_ = 0;
+    int size_ = 0;
+    int num_actions_ = 0;
+    bool has_logits_ = false;
+    int stride_ = 0;
 };
 
 class StopToken {